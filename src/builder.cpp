@@ -1,4 +1,11 @@
 #include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <chrono>
 #include "builder.h"
 
 vguard<int> TransBuilder::edgeFlagsToCountLookup ({ 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 });
@@ -14,156 +21,237 @@ TransBuilder::TransBuilder (Pos len)
     controlWordAtEnd (false),
     startAndEndUseSameControlWord (false),
     buildDelayedMachine (false),
-    kmerValid (maxKmer + 1)
+    nThreads (1),
+    nDroppedEdges (0)
 { }
 
 void TransBuilder::findCandidates() {
   ProgressLog (plogReps, 1);
   plogReps.initProgress ("Filtering %d-mer repeats", len);
+  const KmerRepeatFilter repeatFilter (len, maxTandemRepeatLen, 2, maxTandemRepeatLen, invertedRepeatLen, 2);
+  const bool explainRejects = LoggingThisAt(4);
+
+  // split the k-mer range into contiguous shards, one per thread
+  const size_t nShards = max (1, min (nThreads, (int) min ((Kmer) 1024, maxKmer + 1)));
+  const Kmer shardSize = maxKmer / nShards + 1;
+  vguard<vguard<Kmer> > shardKmers (nShards);
+  if (nShards == 1)
+    findCandidatesInRange (0, maxKmer, repeatFilter, explainRejects, shardKmers[0], &plogReps);
+  else {
+    LogThisAt(3,"Filtering " << len << "-mers in " << nShards << " threads" << endl);
+    list<thread> threads;
+    for (size_t shard = 0; shard < nShards; ++shard) {
+      const Kmer first = shard * shardSize, last = min (maxKmer, first + shardSize - 1);
+      threads.push_back (thread (&TransBuilder::findCandidatesInRange, this, first, last, cref(repeatFilter), explainRejects, ref(shardKmers[shard]), shard == 0 ? &plogReps : (ProgressLogger*) NULL));
+      logger.nameLastThread (threads, "filter");
+    }
+    for (auto& t: threads) {
+      t.join();
+      logger.eraseThreadName (t);
+    }
+  }
+
+  // merge the shards, which are already sorted
   kmers.clear();
-  for (Kmer kmer = 0; kmer <= maxKmer; ++kmer) {
-    plogReps.logProgress (kmer / (double) maxKmer, "sequence %llu/%llu", kmer, maxKmer);
-      
-    if (!endsWithMotif(kmer,len,excludedMotif,"excluded motif")
-	&& !endsWithMotif(kmer,len,excludedMotifRevComp,"revcomp of excluded motif")
-	&& !hasExactTandemRepeat(kmer,len,maxTandemRepeatLen)
-	&& !hasExactLocalInvertedRepeat(kmer,len,2,maxTandemRepeatLen)
-	&& !hasExactNonlocalInvertedRepeat(kmer,len,invertedRepeatLen,2)) {
-      LogThisAt(9,"Accepting " << kmerString(kmer,len) << endl);
+  for (const auto& sk: shardKmers)
+    for (auto kmer: sk) {
       kmerValid[kmer] = true;
       kmers.push_back (kmer);
     }
-  }
+
   const auto nKmersWithoutReps = kmers.size();
   LogThisAt(2,"Found " << nKmersWithoutReps << " candidate " << len << "-mers without repeats (" << setprecision(2) << 100*(double)nKmersWithoutReps/(1.+(double)maxKmer) << "%)" << endl);
 }
 
+void TransBuilder::findCandidatesInRange (Kmer first, Kmer last, const KmerRepeatFilter& repeatFilter, bool explainRejects, vguard<Kmer>& found, ProgressLogger* plog) const {
+  for (Kmer kmer = first; kmer <= last; ++kmer) {
+    if (plog && (kmer & 0xffff) == 0)
+      plog->logProgress ((kmer - first) / (double) (last - first + 1), "sequence %llu/%llu", kmer, last);
+
+    if (repeatFilter.hasRepeat(kmer)) {
+      if (explainRejects)  // the word-parallel filter doesn't say why; re-run the slow tests, which do
+	(void) (endsWithMotif(kmer,len,excludedMotif,"excluded motif")
+		|| endsWithMotif(kmer,len,excludedMotifRevComp,"revcomp of excluded motif")
+		|| hasExactTandemRepeat(kmer,len,maxTandemRepeatLen)
+		|| hasExactLocalInvertedRepeat(kmer,len,2,maxTandemRepeatLen)
+		|| hasExactNonlocalInvertedRepeat(kmer,len,invertedRepeatLen,2));
+      continue;
+    }
+
+    if (!endsWithMotif(kmer,len,excludedMotif,"excluded motif")
+	&& !endsWithMotif(kmer,len,excludedMotifRevComp,"revcomp of excluded motif")) {
+      LogThisAt(9,"Accepting " << kmerString(kmer,len) << endl);
+      found.push_back (kmer);
+    }
+  }
+}
+
 void TransBuilder::pruneUnreachable() {
-  map<Kmer,Pos> dist;
+  vguard<Kmer> roots;
   for (const auto& kl: sourceMotif)
     if (kl.len == len)
-      doDFS (kl.kmer, dist);
-  if (kmers.size() && !dist.size())
-    doDFS (kmers.front(), dist);
+      roots.push_back (kl.kmer);
+  if (kmers.size() && roots.empty())
+    roots.push_back (kmers.front());
+  vguard<Kmer> reached;
+  doDFS (roots, reached);
   unsigned long long nDropped = 0;
   for (auto kmer: kmers)
-    if (!dist.count(kmer)) {
+    if (!kmerReached[kmer]) {
       LogThisAt(6,"Dropping " << kmerString(kmer,len) << " as it was not seen in depth-first search" << endl);
-      kmerValid[kmer] = false;
+      invalidateKmer (kmer);
       ++nDropped;
     }
   if (nDropped) {
     LogThisAt(4,"Dropped " << nDropped << " " << len << "-mers that were unreachable in depth-first search" << endl);
-    kmers.clear();
-    for (const auto& kd: dist)
-      kmers.push_back (kd.first);
-    pruneDeadEnds();
+    kmers.remove_if ([&] (Kmer kmer) { return !kmerReached[kmer]; });
+    for (auto root: roots)  // the search starts from every root, even if it is not a valid k-mer
+      if (find (kmers.begin(), kmers.end(), root) == kmers.end())
+	kmers.insert (lower_bound (kmers.begin(), kmers.end(), root), root);
   } else
     LogThisAt(5,"All " << kmers.size() << " " << len << "-mers were reached in depth-first search" << endl);
+  for (auto kmer: reached)
+    kmerReached[kmer] = false;
+  if (nDropped)
+    pruneDeadEnds();
 }
 
-void TransBuilder::doDFS (Kmer kmer, map<Kmer,Pos>& distance) const {
+void TransBuilder::doDFS (const vguard<Kmer>& roots, vguard<Kmer>& reached) {
+  if (kmerReached.size() != maxKmer + 1)
+    kmerReached = BitArray (maxKmer + 1, mappedDir);
   EdgeVector nbr;
-  list<Kmer> kqueue;
-  list<Pos> kdist;
-  kqueue.push_back (kmer);
-  kdist.push_back (0);
-  while (!kqueue.empty()) {
-    kmer = kqueue.back();
-    const auto d = kdist.back();
+  vguard<Kmer> kstack (roots.rbegin(), roots.rend());
+  while (!kstack.empty()) {
+    const Kmer kmer = kstack.back();
     LogThisAt(9,"Depth-first search: visiting " << kmerString(kmer,len) << endl);
-    kqueue.pop_back();
-    kdist.pop_back();
-    if (!distance.count(kmer)) {
-      distance[kmer] = d;
+    kstack.pop_back();
+    if (!kmerReached[kmer]) {
+      kmerReached[kmer] = true;
+      reached.push_back (kmer);
       getOutgoing (kmer, nbr);
       for (auto n: nbr)
 	if (kmerValid[n]
 	    && !endsWithMotif(n,len,sourceMotif)
-	    && !droppedEdge.count (pair<Kmer,Kmer> (kmer, n))
-	    && !distance.count(n)) {
-	  kqueue.push_back (n);
-	  kdist.push_back (d + 1);
-	}
+	    && !isDroppedEdge (kmer, n)
+	    && !kmerReached[n])
+	  kstack.push_back (n);
     }
   }
 }
 
-set<Kmer> TransBuilder::kmersEndingWith (KmerLen motif) const {
-  set<Kmer> result;
+Pos TransBuilder::stepsToReach (KmerLen motif, int maxSteps) const {
+  // frontier holds the k-mers that can reach motif in exactly the current number of steps
+  vguard<Kmer> frontier;
   for (auto kmer: kmers)
     if (endsWithMotif(kmer,len,motif))
-      result.insert(kmer);
-  return result;
-}
-
-Pos TransBuilder::stepsToReach (KmerLen motif, int maxSteps) const {
-  set<Kmer> nbr = kmersEndingWith(motif);
-  EdgeVector in;
+      frontier.push_back (kmer);
+  if (kmerInFrontier.size() != maxKmer + 1)
+    kmerInFrontier = BitArray (maxKmer + 1, mappedDir);
+  vguard<KmerStep> kmerSteps;
   for (int steps = 0; steps < maxSteps; ++steps) {
-    if (nbr.size() == kmers.size())
+    if (frontier.size() == kmers.size())
       return steps;
-    set<Kmer> prev;
-    for (auto kmer: nbr)
-      if (!(endsWithMotif(kmer,len,sourceMotif) || endsWithMotif(kmer,len,motif))
-	  || steps == 0) {
-	getIncoming (kmer, in);
-	for (auto p: in)
-	  if (kmerValid[p])
-	    prev.insert (p);
+    expandFrontier (frontier,
+		    [&] (Kmer src, Kmer dest) {
+		      return kmerValid[src]
+			&& (steps == 0 || !(endsWithMotif(dest,len,sourceMotif) || endsWithMotif(dest,len,motif)));
+		    },
+		    kmerSteps);
+    frontier.clear();
+    for (const auto& ks: kmerSteps)
+      if (!kmerInFrontier[ks.first]) {
+	kmerInFrontier[ks.first] = true;
+	frontier.push_back (ks.first);
       }
-    nbr.swap (prev);
+    for (auto kmer: frontier)
+      kmerInFrontier[kmer] = false;
   }
   return -1;
 }
 
-map<Kmer,list<Kmer> > TransBuilder::pathsTo (Kmer dest, int steps) const {
-  map<Kmer,list<Kmer> > pathFrom;
-  pathFrom[dest] = list<Kmer>();
-  EdgeVector in;
+BridgePaths TransBuilder::pathsTo (Kmer dest, int steps) const {
+  BridgePaths paths (steps);
+  paths.level[steps].push_back (dest);
+  vguard<KmerStep> kmerSteps;
   for (int step = steps - 1; step >= 0; --step) {
-    map<Kmer,list<Kmer> > longerPathFrom;
-    for (auto interPath: pathFrom) {
-      const Kmer inter = interPath.first;
-      getIncoming (inter, in);
-      for (auto src: in)
-	if (kmerValid[src]
-	    && (!(endsWithMotif(src,len,sourceMotif) || src == dest)
-		|| step == 0))
-	  (longerPathFrom[src] = interPath.second).push_front (inter);
-    }
-    pathFrom.swap (longerPathFrom);
+    expandFrontier (paths.level[step+1],
+		    [&] (Kmer src, Kmer) {
+		      return kmerValid[src]
+			&& (!(endsWithMotif(src,len,sourceMotif) || src == dest)
+			    || step == 0);
+		    },
+		    kmerSteps);
+    // where there is a choice of next k-mer, use the greatest
+    sort (kmerSteps.begin(), kmerSteps.end());
+    auto& level = paths.level[step];
+    auto& next = paths.next[step];
+    for (size_t i = 0; i < kmerSteps.size(); ++i)
+      if (i + 1 == kmerSteps.size() || kmerSteps[i+1].first != kmerSteps[i].first) {
+	level.push_back (kmerSteps[i].first);
+	next.push_back (kmerSteps[i].second);
+      }
   }
-  return pathFrom;
+  return paths;
 }
 
 void TransBuilder::pruneDeadEnds() {
+  deque<Kmer> worklist (kmers.begin(), kmers.end());
+  pruneDeadEnds (worklist);
+}
+
+void TransBuilder::pruneDeadEnds (deque<Kmer>& worklist) {
   ProgressLog (plogPrune, 3);
   plogPrune.initProgress ("Pruning dead ends");
-  for (auto kmer: kmers)
-    pruneDeadEnds (kmer);
-  const unsigned long long nKmers = kmers.size();
-  unsigned long long nPruned = 0, nUnpruned = 0;
-  list<Kmer> unprunedKmers;
-  for (auto kmer: kmers) {
-    ++nPruned;
-    plogPrune.logProgress (nPruned / (double) nKmers, "sequence %llu/%llu", nPruned, nKmers);
-    if (kmerValid[kmer]) {
-      unprunedKmers.push_back (kmer);
-      ++nUnpruned;
+  if (kmerQueued.size() != maxKmer + 1)
+    kmerQueued = BitArray (maxKmer + 1, mappedDir);
+  for (auto kmer: worklist)
+    kmerQueued[kmer] = true;
+  EdgeVector in, out;
+  unsigned long long nVisited = 0;
+  while (!worklist.empty()) {
+    const Kmer kmer = worklist.front();
+    worklist.pop_front();
+    kmerQueued[kmer] = false;
+    if ((++nVisited & 0xffff) == 0)
+      plogPrune.logProgress (nVisited / (double) (nVisited + worklist.size()), "sequence %llu/%llu", nVisited, nVisited + worklist.size());
+    if (kmerValid[kmer] && !endsWithMotif(kmer,len,sourceMotif)) {
+      const int inCount = countIncoming(kmer,in), outCount = countOutgoing(kmer,out);
+      const bool prune = inCount == 0 || outCount == 0;
+      LogThisAt(9,(prune ? "Pruning" : "Keeping") << " " << kmerString(kmer,len) << " with " << inCount << " incoming and " << outCount << " outgoing edges" << endl);
+      if (prune) {
+	invalidateKmer (kmer);
+	for (const EdgeVector* nbrs: { &in, &out })
+	  for (auto nbr: *nbrs)
+	    queueDeadEndCandidate (nbr, worklist);
+      }
     }
   }
-  LogThisAt(4,"Dead-end pruning removed " << (nPruned - nUnpruned) << " " << len << "-mers, leaving " << nUnpruned << endl);
-  kmers.swap (unprunedKmers);
+  const unsigned long long nKmers = kmers.size();
+  kmers.remove_if ([&] (Kmer kmer) { return !kmerValid[kmer]; });
+  LogThisAt(4,"Dead-end pruning removed " << (nKmers - kmers.size()) << " " << len << "-mers, leaving " << kmers.size() << endl);
+}
+
+void TransBuilder::restoreInvalidatedKmers (size_t undoMark) {
+  vguard<Kmer> restored (invalidatedKmers.begin() + undoMark, invalidatedKmers.end());
+  invalidatedKmers.erase (invalidatedKmers.begin() + undoMark, invalidatedKmers.end());
+  for (auto kmer: restored)
+    kmerValid[kmer] = true;
+  sort (restored.begin(), restored.end());
+  list<Kmer> restoredList (restored.begin(), restored.end());
+  kmers.merge (restoredList);
+  LogThisAt(6,"Restored " << restored.size() << " " << len << "-mers" << endl);
 }
 
 void TransBuilder::assertKmersCorrect() const {
-  const set<Kmer> kmerSet (kmers.begin(), kmers.end());
-  for (Kmer kmer = 0; kmer <= maxKmer; ++kmer)
-    if (kmerValid[kmer])
-      Assert (kmerSet.count(kmer), "Missing kmer %s from kmer list", kmerString(kmer,len).c_str());
-  for (Kmer kmer: kmers)
+  // if the list is strictly ascending, all its k-mers are valid, and it has as many entries as there are valid k-mers,
+  // then it contains every valid k-mer; this avoids a pass over all 4^len k-mers
+  const Kmer* prev = NULL;
+  for (const Kmer& kmer: kmers) {
     Assert (kmerValid[kmer], "Invalid kmer %s in kmer list", kmerString(kmer,len).c_str());
+    Assert (!prev || *prev < kmer, "Kmer %s is out of order or duplicated in kmer list", kmerString(kmer,len).c_str());
+    prev = &kmer;
+  }
+  Assert (kmerValid.popcount() == kmers.size(), "Kmer list has %llu entries, but there are %llu valid kmers", (unsigned long long) kmers.size(), (unsigned long long) kmerValid.popcount());
 }
 
 void TransBuilder::buildEdges() {
@@ -177,10 +265,10 @@ void TransBuilder::buildEdges() {
       if ((outFlags & PyrimidineFlags) == PyrimidineFlags)
 	outFlags = dropWorseEdge (kmer, outFlags, out, CytosineBase, ThymineBase);
     }
-    kmerOutFlags[kmer] = outFlags;
+    setKmerOutFlags (kmer, outFlags);
   }
   if (!keepDegenerates)
-    LogThisAt(2,"Dropped " << droppedEdge.size() << " degenerate transitions" << endl);
+    LogThisAt(2,"Dropped " << nDroppedEdges << " degenerate transitions" << endl);
   pruneUnreachable();
 }
 
@@ -194,27 +282,59 @@ void TransBuilder::indexStates() {
     nStates++;
   if (isStartControlIndex(0) && isEndControlIndex(0))
     ++nStates;
-  for (auto kmer: controlWord)
-    kmerState[kmer] = nStates++;
-  for (auto kmer: kmers)
-    if (!kmerState.count(kmer) && endsWithMotif(kmer,len,sourceMotif))
-      kmerState[kmer] = nStates++;
+  // state numbers for k-mers are computed arithmetically from rank queries on bit vectors,
+  // which requires the k-mer list to be in ascending order, so the n'th k-mer in the list is the one with kmerIndex n
+  Assert (is_sorted (kmers.begin(), kmers.end()), "K-mer list is not sorted");
+  kmerValid.buildIndex();
+  Assert (kmerValid.count() == kmers.size(), "Kmer list has %llu entries, but there are %llu valid kmers", (unsigned long long) kmers.size(), (unsigned long long) kmerValid.count());
+  firstControlState = nStates;
+  nStates += controlWord.size();
+  sourceKmerBits = RankBitVector (kmers.size(), mappedDir);
+  ordinaryKmerBits = RankBitVector (kmers.size(), mappedDir);
+  twoWayKmerBits = RankBitVector (kmers.size(), mappedDir);
+  threeWayKmerBits = RankBitVector (kmers.size(), mappedDir);
+  fourWayKmerBits = RankBitVector (kmers.size(), mappedDir);
+  size_t k = 0;
+  for (auto kmer: kmers) {
+    if (find (controlWord.begin(), controlWord.end(), kmer) == controlWord.end()) {
+      if (endsWithMotif(kmer,len,sourceMotif))
+	sourceKmerBits.set (k);
+      else
+	ordinaryKmerBits.set (k);
+    }
+    ++k;
+  }
+  sourceKmerBits.buildIndex();
+  ordinaryKmerBits.buildIndex();
+  firstSourceState = nStates;
+  nStates += sourceKmerBits.count();
   firstNonControlState = nStates;
-  for (auto kmer: kmers)
-    if (!kmerState.count(kmer))
-      kmerState[kmer] = nStates++;
+  nStates += ordinaryKmerBits.count();
+  k = 0;
   for (auto kmer: kmers) {
-    const auto nOut = countOutgoing(kmer);
+    const auto nOut = edgeFlagsToCount (kmerOutFlags (kmer));
+    if (nOut == 2)
+      twoWayKmerBits.set (k);
     if (nOut > 2)
-      kmerStateZero[kmer] = nStates++;
+      threeWayKmerBits.set (k);
     if (nOut > 3)
-      kmerStateOne[kmer] = nStates++;
+      fourWayKmerBits.set (k);
+    ++k;
   }
+  twoWayKmerBits.buildIndex();
+  threeWayKmerBits.buildIndex();
+  fourWayKmerBits.buildIndex();
+  firstSplitState = nStates;
+  nStates += threeWayKmerBits.count() + fourWayKmerBits.count();
+  firstBridgeState = nStates;
+  bridgeKmer.clear();
   for (size_t c = 0; c < nControlWords; ++c) {
     vguard<map<Kmer,State> > ckState (controlWordSteps[c]);
     for (Pos step = 0; step < controlWordSteps[c] - 1; ++step)
-      for (auto kmer: controlWordIntermediates[c][step])
+      for (auto kmer: controlWordIntermediates[c][step]) {
 	ckState[step][kmer] = nStates++;
+	bridgeKmer.push_back (kmer);
+      }
     controlKmerState.push_back (ckState);
   }
 
@@ -224,210 +344,397 @@ void TransBuilder::indexStates() {
   endState = nStates++;
 }
 
+void TransBuilder::allocKmerTables() {
+  if (mappedDir.size())
+    LogThisAt(2,"Mapping " << len << "-mer tables to temporary files in " << mappedDir << endl);
+  kmerValid = RankBitVector (maxKmer + 1, mappedDir);
+  kmerEdgeFlags = MappedArray<EdgeFlags> (maxKmer + 1, mappedDir);
+  nDroppedEdges = 0;
+}
+
 void TransBuilder::prepare() {
-  findCandidates();
-  pruneDeadEnds();
-  pruneUnreachable();
-  getControlWords();
-  buildEdges();
-  indexStates();
+  buildProfile.clear();
+  profilePhase ("allocKmerTables", [&] { allocKmerTables(); });
+  profilePhase ("findCandidates", [&] { findCandidates(); });
+  profilePhase ("pruneDeadEnds", [&] { pruneDeadEnds(); });
+  profilePhase ("pruneUnreachable", [&] { pruneUnreachable(); });
+  profilePhase ("getControlWords", [&] { getControlWords(); });
+  buildProfile.back().counts["controlWords"] = controlWord.size();
+  profilePhase ("buildEdges", [&] { buildEdges(); });
+  buildProfile.back().counts["droppedEdges"] = nDroppedEdges;
+  profilePhase ("indexStates", [&] { indexStates(); });
+  buildProfile.back().counts["states"] = nStates;
+  buildProfile.back().counts["bridgeStates"] = bridgeKmer.size();
 }
 
-Machine TransBuilder::makeMachine() {
+void TransBuilder::profilePhase (const char* name, const function<void()>& phase) {
+  auto cpuSeconds = [] (const struct rusage& ru) {
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+  };
+  struct rusage ruStart, ruEnd;
+  getrusage (RUSAGE_SELF, &ruStart);
+  const auto wallStart = chrono::steady_clock::now();
+  phase();
+  const auto wallEnd = chrono::steady_clock::now();
+  getrusage (RUSAGE_SELF, &ruEnd);
+  BuildPhaseProfile profile;
+  profile.name = name;
+  profile.wallSeconds = chrono::duration<double> (wallEnd - wallStart).count();
+  profile.cpuSeconds = cpuSeconds(ruEnd) - cpuSeconds(ruStart);
+  profile.peakRssKb = ruEnd.ru_maxrss;
+  profile.counts["kmers"] = kmers.size();
+  buildProfile.push_back (profile);
+  LogThisAt(3,"Phase " << name << " took " << profile.wallSeconds << "s (" << profile.cpuSeconds << "s CPU), peak RSS " << profile.peakRssKb << "KB" << endl);
+}
+
+void TransBuilder::writeBuildProfileJSON (ostream& out) const {
+  out << "{\n";
+  out << " \"len\": " << len << ",\n";
+  out << " \"threads\": " << nThreads << ",\n";
+  out << " \"phases\": [";
+  for (size_t n = 0; n < buildProfile.size(); ++n) {
+    const BuildPhaseProfile& p = buildProfile[n];
+    vguard<string> counts;
+    for (const auto& c: p.counts)
+      counts.push_back (string("\"") + c.first + "\": " + to_string(c.second));
+    out << (n ? "," : "") << "\n  { \"phase\": \"" << p.name << "\""
+	<< ", \"wallSeconds\": " << p.wallSeconds
+	<< ", \"cpuSeconds\": " << p.cpuSeconds
+	<< ", \"peakRssKb\": " << p.peakRssKb
+	<< ", \"counts\": { " << join(counts,", ") << " } }";
+  }
+  out << "\n ]\n";
+  out << "}\n";
+}
+
+string TransBuilder::configDescription() const {
+  ostringstream desc;
+  desc << "dnastore machine cache v1" << endl
+       << "builder " << builderVersion << endl
+       << "len " << len << endl
+       << "tandem " << maxTandemRepeatLen << endl
+       << "invrep " << invertedRepeatLen << endl
+       << "exclude";
+  for (const auto& kl: excludedMotif)
+    desc << ' ' << kmerString(kl);
+  desc << endl << "exclude-revcomp";
+  for (const auto& kl: excludedMotifRevComp)
+    desc << ' ' << kmerString(kl);
+  desc << endl << "source";
+  for (const auto& kl: sourceMotif)
+    desc << ' ' << kmerString(kl);
+  desc << endl
+       << "keep-degenerates " << keepDegenerates << endl
+       << "controls " << nControlWords << endl
+       << "control-at-start " << controlWordAtStart << endl
+       << "control-at-end " << controlWordAtEnd << endl
+       << "delay " << buildDelayedMachine << endl;
+  return desc.str();
+}
+
+string TransBuilder::cacheFilename (const string& cacheDir) const {
+  // 64-bit FNV-1a hash of the configuration
+  unsigned long long hash = 0xcbf29ce484222325ULL;
+  for (unsigned char c: configDescription())
+    hash = (hash ^ c) * 0x100000001b3ULL;
+  ostringstream filename;
+  filename << cacheDir << "/dnastore-" << hex << setw(16) << setfill('0') << hash << ".json";
+  return filename.str();
+}
+
+Machine TransBuilder::makeCachedMachine (const string& cacheDir, bool useCached) {
+  const string filename = cacheFilename (cacheDir);
+  if (useCached) {
+    ifstream infile (filename);
+    if (infile) {
+      LogThisAt(2,"Loading cached machine from " << filename << endl);
+      return Machine::fromJSON (infile);
+    }
+  }
+  const Machine machine = makeMachine();
+  // write to a temporary file & rename, so concurrent jobs never see a partial machine
+  mkdir (cacheDir.c_str(), 0777);
+  const string tmpFilename = filename + "." + to_string(getpid()) + ".tmp";
+  ofstream outfile (tmpFilename);
+  if (outfile) {
+    machine.writeJSON (outfile);
+    outfile.close();
+    if (outfile && rename (tmpFilename.c_str(), filename.c_str()) == 0)
+      LogThisAt(2,"Saved machine to cache " << filename << endl);
+    else {
+      remove (tmpFilename.c_str());
+      Warn ("Couldn't save machine to cache %s", filename.c_str());
+    }
+  } else
+    Warn ("Couldn't write to cache directory %s", cacheDir.c_str());
+  return machine;
+}
+
+void TransBuilder::prepareMachine() {
   if (buildDelayedMachine) {
     Require (len % 2 == 0, "Delayed machine must have even number of bases per word");
     Require (controlWordAtStart && controlWordAtEnd && nControlWords > 0, "Delayed machine must generate control words at start & end of encoded sequence");
   }
 
   prepare();
+}
+
+Machine TransBuilder::makeMachine() {
+  prepareMachine();
 
   Machine machine;
-  machine.state = vguard<MachineState> (nStates);
+  profilePhase ("makeStates", [&] {
+      machine.state.reserve (nStates);
+      for (State s = 0; s < nStates; ++s)
+	machine.state.push_back (makeState (s));
+    });
+  unsigned long long nTrans = 0;
+  for (const auto& ms: machine.state)
+    nTrans += ms.trans.size();
+  buildProfile.back().counts["states"] = machine.nStates();
+  buildProfile.back().counts["transitions"] = nTrans;
+
+  return machine;
+}
+
+ImplicitMachine TransBuilder::makeImplicitMachine() {
+  prepareMachine();
+  return ImplicitMachine (*this);
+}
+
+MachineState TransBuilder::makeState (State s) const {
+  MachineState ms = makeUndelayedState (s);
+
+  if (buildDelayedMachine) {
+    ms.rightContext = string (ms.leftContext.begin() + len/2, ms.leftContext.end());
+    ms.leftContext.erase (ms.leftContext.begin() + len/2, ms.leftContext.end());
+    for (auto& t: ms.trans)
+      if (t.out)
+	t.out = makeUndelayedState(t.dest).leftContext[len/2 - 1];
+  }
+
+  if (s == 0) {
+    Assert (ms.trans.front().inputEmpty(), "First transition shouldn't have input");
+    ms.trans.front().in = MachineSOF;
+  }
+
+  return ms;
+}
 
-  if (controlWordAtStart) {
-    const Pos p0 = buildDelayedMachine ? len/2 : 0;
-    for (Pos p = p0; p < len; ++p) {
-      const State s = p - p0;
-      MachineState& ms = machine.state[s];
+bool TransBuilder::startAndEndShareControlState() const {
+  return isStartControlIndex(0) && isEndControlIndex(0);
+}
+
+MachineState TransBuilder::makeUndelayedState (State s) const {
+  MachineState ms;
+  const State nStartStates = firstControlState - (startAndEndShareControlState() ? 1 : 0);
+
+  if (s < nStartStates) {
+    if (controlWordAtStart) {
+      const Pos p = s + (buildDelayedMachine ? len/2 : 0);
       ms.leftContext = string(len-p,MachineWildContext) + kmerSubstring(startControlWord(),len-p+1,p);
       ms.name = (s == 0 ? "Start#" : "Load(Start)#") + to_string(s);
       ms.trans.push_back (MachineTransition (MachineNull, baseToChar(getBase(startControlWord(),len-p)), s+1));
+    } else {
+      ms.leftContext = string(len,MachineWildContext);
+      ms.name = "Start#1";
+      ms.trans.push_back (MachineTransition (MachineNull, MachineNull, firstNonControlState));
     }
-  } else {
-    MachineState& ms = machine.state.front();
-    ms.leftContext = string(len,MachineWildContext);
-    ms.name = "Start#1";
-    ms.trans.push_back (MachineTransition (MachineNull, MachineNull, firstNonControlState));
-  }
-  
-  EdgeVector out;
-  vguard<char> outChar;
-  vguard<State> outState;
 
-  int nOut2 = 0, nOut3 = 0, nOut4 = 0;
-  for (auto kmer: kmers) {
-    const State s = kmerState.at(kmer);
-    MachineState& ms = machine.state[s];
+  } else if (s < firstControlState) {
+    // start & end control words are the same k-mer: the Start copy gets all its outgoing transitions
+    const State endControlState = s + 1;
+    ms = makeKmerState (endControlWord(), endControlState);
+    for (auto& t: ms.trans)
+      if (t.dest == endControlState)
+	t.dest = s;   // handle the self-looping MachineFlush transition
+    ms.name = string("Control(Start)") + "#" + to_string(s);
+
+  } else if (s < firstSplitState) {
+    const Kmer kmer = stateKmer (s);
+    ms = makeKmerState (kmer, s);
+    if (controlWordAtEnd && kmer == endControlWord()) {
+      if (startAndEndShareControlState())
+	ms.trans.clear();
+      if (buildDelayedMachine)
+	ms.trans.push_back (MachineTransition (0, MachineWildContext, endState - len/2));
+      else
+	ms.trans.push_back (MachineTransition (0, 0, endState));
+    }
+
+  } else if (s < firstBridgeState) {
+    // find the k-mer with 3 or 4 outgoing edges whose Split0 state is at or just before s
+    const State i = s - firstSplitState;
+    size_t lo = 0, hi = threeWayKmerBits.count();
+    while (hi - lo > 1) {
+      const size_t mid = (lo + hi) / 2;
+      if (mid + fourWayKmerBits.rank (threeWayKmerBits.select (mid)) <= i)
+	lo = mid;
+      else
+	hi = mid;
+    }
+    const size_t k = threeWayKmerBits.select (lo);
+    const Kmer kmer = kmerValid.select (k);
+    const bool isSplit1 = kmerStateZero(kmer) != s;
+    vguard<char> outChar;
+    vguard<State> outState;
+    getKmerOutputs (kmer, outChar, outState);
     ms.leftContext = kmerString(kmer,len);
-    
-    getOutgoing (kmer, out);
-    const EdgeFlags outFlags = kmerOutFlags.at(kmer);
-    outChar.clear();
-    outState.clear();
-    for (size_t n = 0; n < 4; ++n)
-      if (outFlags & (1 << n)) {
-	outChar.push_back (baseToChar(n));
-	outState.push_back (kmerState.at(out[n]));
+    ms.name = string(isSplit1 ? "Split1#" : "Split0#") + to_string(s);
+    if (outChar.size() == 3) {
+      const int rotate3 = (threeWayKmerBits.rank(k) - fourWayKmerBits.rank(k) + 1) % 3;
+      const size_t i3 = rotate3, j3 = (rotate3 + 1) % 3;
+      ms.trans.push_back (MachineTransition (MachineBit0, outChar[i3], outState[i3]));
+      ms.trans.push_back (MachineTransition (MachineBit1, outChar[j3], outState[j3]));
+      ms.trans.push_back (MachineTransition (MachineFlush, outChar[i3], outState[i3]));
+    } else {
+      const int rotate4 = (fourWayKmerBits.rank(k) + 1) % 4;
+      const size_t i4 = rotate4, j4 = (rotate4 + 1) % 4, k4 = (rotate4 + 2) % 4, l4 = (rotate4 + 3) % 4;
+      if (isSplit1) {
+	ms.trans.push_back (MachineTransition (MachineBit0, outChar[k4], outState[k4]));
+	ms.trans.push_back (MachineTransition (MachineBit1, outChar[l4], outState[l4]));
+	ms.trans.push_back (MachineTransition (MachineFlush, outChar[l4], outState[l4]));
+      } else {
+	ms.trans.push_back (MachineTransition (MachineBit0, outChar[i4], outState[i4]));
+	ms.trans.push_back (MachineTransition (MachineBit1, outChar[j4], outState[j4]));
+	ms.trans.push_back (MachineTransition (MachineFlush, outChar[i4], outState[i4]));
       }
+    }
 
-    ms.name = "Code";
-    if (endsWithMotif(kmer,len,sourceMotif)) {
-      ms.name = "Source";
-      for (size_t c = 0; c < controlWord.size(); ++c)
-	if (kmer == controlWord[c]) {
-	  if (isEndControlIndex(c))
-	    ms.name = string("Control(End)");
-	  else if (isStartControlIndex(c))
-	    ms.name = string("Control(Start)");
-	  else
-	    ms.name = string("Control(") + controlChar(c) + ")";
+  } else if (s < firstBridgeState + bridgeKmer.size()) {
+    const Kmer srcKmer = bridgeKmer[s - firstBridgeState];
+    State stepStart = firstBridgeState;
+    for (size_t c = 0; c < controlKmerState.size(); ++c)
+      for (int step = 0; step < controlWordSteps[c] - 1; ++step) {
+	const State stepEnd = stepStart + controlKmerState[c][step].size();
+	if (s < stepEnd) {
+	  const Kmer destKmer = nextIntermediateKmer (srcKmer, c, step + 1);
+	  ms.leftContext = kmerString(srcKmer,len);
+	  ms.name = (isEndControlIndex(c) ? string("Bridge(End)") : (string("Bridge(") + controlChar(c) + ")")) + "#" + to_string(s);
+	  ms.trans.push_back (controlTrans (s, destKmer, c, step + 1));
+	  return ms;
 	}
-    }
-    ms.name += "#" + to_string(s);
+	stepStart = stepEnd;
+      }
+
+  } else if (s < endState) {
+    Assert (buildDelayedMachine, "State %llu out of range", s);
+    const Pos pos = s + 1 + len/2 - endState;
+    ms.name = string("Unload(End)#") + to_string(s);
+    ms.leftContext = kmerSubstring(endControlWord(),1,len-pos) + string(pos,MachineWildContext);
+    if (pos < len/2)
+      ms.trans.push_back (MachineTransition (0, MachineWildContext, s + 1));
+    else
+      ms.trans.push_back (MachineTransition (0, 0, endState));
+
+  } else {
+    Assert (s == endState, "State %llu out of range", s);
+    ms.name = "End#" + to_string(endState);
+    ms.leftContext = buildDelayedMachine
+      ? (kmerSubstring(endControlWord(),1,len/2) + string(len/2,MachineWildContext))
+      : (controlWordAtEnd ? kmerString(endControlWord(),len) : string(len,MachineWildContext));
+  }
+
+  return ms;
+}
+
+Kmer TransBuilder::stateKmer (State s) const {
+  if (s >= firstNonControlState)
+    return kmerValid.select (ordinaryKmerBits.select (s - firstNonControlState));
+  if (s >= firstSourceState)
+    return kmerValid.select (sourceKmerBits.select (s - firstSourceState));
+  return controlWord[s - firstControlState];
+}
 
-    if (outChar.size() == 1)
-      ms.trans.push_back (MachineTransition (MachineNull, outChar[0], outState[0]));
+void TransBuilder::getKmerOutputs (Kmer kmer, vguard<char>& outChar, vguard<State>& outState) const {
+  EdgeVector out;
+  getOutgoing (kmer, out);
+  const EdgeFlags outFlags = kmerOutFlags(kmer);
+  outChar.clear();
+  outState.clear();
+  for (size_t n = 0; n < 4; ++n)
+    if (outFlags & (1 << n)) {
+      outChar.push_back (baseToChar(n));
+      outState.push_back (kmerState(out[n]));
+    }
+}
 
-    else if (outChar.size() == 2) {
-      const int rotate2 = (++nOut2 % 2);
-      const size_t i2 = rotate2, j2 = (rotate2 + 1) % 2;
-      ms.trans.push_back (MachineTransition (MachineBit0, outChar[i2], outState[i2]));
-      ms.trans.push_back (MachineTransition (MachineBit1, outChar[j2], outState[j2]));
+MachineState TransBuilder::makeKmerState (Kmer kmer, State s) const {
+  MachineState ms;
+  ms.leftContext = kmerString(kmer,len);
 
-      ms.trans.push_back (MachineTransition (MachineFlush, MachineNull, s));
+  vguard<char> outChar;
+  vguard<State> outState;
+  getKmerOutputs (kmer, outChar, outState);
+
+  ms.name = "Code";
+  if (endsWithMotif(kmer,len,sourceMotif)) {
+    ms.name = "Source";
+    for (size_t c = 0; c < controlWord.size(); ++c)
+      if (kmer == controlWord[c]) {
+	if (isEndControlIndex(c))
+	  ms.name = string("Control(End)");
+	else if (isStartControlIndex(c))
+	  ms.name = string("Control(Start)");
+	else
+	  ms.name = string("Control(") + controlChar(c) + ")";
+      }
+  }
+  ms.name += "#" + to_string(s);
 
-      ms.trans.push_back (MachineTransition (MachineStrictBit0, outChar[i2], outState[i2]));
-      ms.trans.push_back (MachineTransition (MachineStrictBit1, outChar[j2], outState[j2]));
+  // the assignment of bits to output bases rotates from one k-mer to the next (in k-mer order) among k-mers with the same out-degree
+  const size_t k = kmerIndex (kmer);
+  if (outChar.size() == 1)
+    ms.trans.push_back (MachineTransition (MachineNull, outChar[0], outState[0]));
 
-    } else if (outChar.size() == 3) {
-      const int rotate3 = (++nOut3 % 3);
-      const size_t i3 = rotate3, j3 = (rotate3 + 1) % 3, k3 = (rotate3 + 2) % 3;
-      const State s0 = kmerStateZero.at(kmer);
-      ms.trans.push_back (MachineTransition (MachineBit0, MachineNull, s0));
-      ms.trans.push_back (MachineTransition (MachineBit1, outChar[k3], outState[k3]));
+  else if (outChar.size() == 2) {
+    const int rotate2 = (twoWayKmerBits.rank(k) + 1) % 2;
+    const size_t i2 = rotate2, j2 = (rotate2 + 1) % 2;
+    ms.trans.push_back (MachineTransition (MachineBit0, outChar[i2], outState[i2]));
+    ms.trans.push_back (MachineTransition (MachineBit1, outChar[j2], outState[j2]));
 
-      machine.state[s0].leftContext = kmerString(kmer,len);
-      machine.state[s0].name = string("Split0#") + to_string(s0);
-      machine.state[s0].trans.push_back (MachineTransition (MachineBit0, outChar[i3], outState[i3]));
-      machine.state[s0].trans.push_back (MachineTransition (MachineBit1, outChar[j3], outState[j3]));
+    ms.trans.push_back (MachineTransition (MachineFlush, MachineNull, s));
 
-      ms.trans.push_back (MachineTransition (MachineFlush, MachineNull, s));
-      machine.state[s0].trans.push_back (MachineTransition (MachineFlush, outChar[i3], outState[i3]));
+    ms.trans.push_back (MachineTransition (MachineStrictBit0, outChar[i2], outState[i2]));
+    ms.trans.push_back (MachineTransition (MachineStrictBit1, outChar[j2], outState[j2]));
 
-      ms.trans.push_back (MachineTransition (MachineStrictTrit0, outChar[i3], outState[i3]));
-      ms.trans.push_back (MachineTransition (MachineStrictTrit1, outChar[j3], outState[j3]));
-      ms.trans.push_back (MachineTransition (MachineStrictTrit2, outChar[k3], outState[k3]));
+  } else if (outChar.size() == 3) {
+    const int rotate3 = (threeWayKmerBits.rank(k) - fourWayKmerBits.rank(k) + 1) % 3;
+    const size_t i3 = rotate3, j3 = (rotate3 + 1) % 3, k3 = (rotate3 + 2) % 3;
+    ms.trans.push_back (MachineTransition (MachineBit0, MachineNull, kmerStateZero(kmer)));
+    ms.trans.push_back (MachineTransition (MachineBit1, outChar[k3], outState[k3]));
 
-    } else if (outChar.size() == 4) {
-      const int rotate4 = (++nOut4 % 4);
-      const size_t i4 = rotate4, j4 = (rotate4 + 1) % 4, k4 = (rotate4 + 2) % 4, l4 = (rotate4 + 3) % 4;
-      const State s0 = kmerStateZero.at(kmer);
-      const State s1 = kmerStateOne.at(kmer);
-      ms.trans.push_back (MachineTransition (MachineBit0, MachineNull, s0));
-      ms.trans.push_back (MachineTransition (MachineBit1, MachineNull, s1));
-
-      machine.state[s0].leftContext = kmerString(kmer,len);
-      machine.state[s0].name = string("Split0#") + to_string(s0);
-      machine.state[s0].trans.push_back (MachineTransition (MachineBit0, outChar[i4], outState[i4]));
-      machine.state[s0].trans.push_back (MachineTransition (MachineBit1, outChar[j4], outState[j4]));
-
-      machine.state[s1].leftContext = kmerString(kmer,len);
-      machine.state[s1].name = string("Split1#") + to_string(s1);
-      machine.state[s1].trans.push_back (MachineTransition (MachineBit0, outChar[k4], outState[k4]));
-      machine.state[s1].trans.push_back (MachineTransition (MachineBit1, outChar[l4], outState[l4]));
-
-      ms.trans.push_back (MachineTransition (MachineFlush, MachineNull, s));
-      machine.state[s0].trans.push_back (MachineTransition (MachineFlush, outChar[i4], outState[i4]));
-      machine.state[s1].trans.push_back (MachineTransition (MachineFlush, outChar[l4], outState[l4]));
-
-      ms.trans.push_back (MachineTransition (MachineStrictQuat0, outChar[i4], outState[i4]));
-      ms.trans.push_back (MachineTransition (MachineStrictQuat1, outChar[j4], outState[j4]));
-      ms.trans.push_back (MachineTransition (MachineStrictQuat2, outChar[k4], outState[k4]));
-      ms.trans.push_back (MachineTransition (MachineStrictQuat3, outChar[l4], outState[l4]));
-    }
-    
-    if (outChar.size() > 1) {
-      for (size_t c = 0; c < controlWord.size(); ++c) {
-	if (isSourceControlIndex(c))
-	  continue;
-	ms.trans.push_back (controlTrans (s, controlWordPath[c].at(kmer).front(), c, 0));
-      }
-      if (!controlWordAtEnd)
-	ms.trans.push_back (MachineTransition (MachineEOF, 0, endState));
-    }
-    if (controlWordAtEnd && kmer == endControlWord()) {
+    ms.trans.push_back (MachineTransition (MachineFlush, MachineNull, s));
 
-      if (isStartControlIndex(0) && isEndControlIndex(0)) {
-	for (auto& t: ms.trans)
-	  if (t.dest == s)
-	    t.dest = s - 1;   // handle the self-looping MachineFlush transition
-	swap (ms.trans, machine.state[s-1].trans);  // give the Start copy all the outgoing transitions
-	machine.state[s-1].leftContext = ms.leftContext;
-	machine.state[s-1].name = string("Control(Start)") + "#" + to_string(s-1);
-      }
+    ms.trans.push_back (MachineTransition (MachineStrictTrit0, outChar[i3], outState[i3]));
+    ms.trans.push_back (MachineTransition (MachineStrictTrit1, outChar[j3], outState[j3]));
+    ms.trans.push_back (MachineTransition (MachineStrictTrit2, outChar[k3], outState[k3]));
 
-      if (buildDelayedMachine)
-	ms.trans.push_back (MachineTransition (0, MachineWildContext, endState - len/2));
-      else
-	ms.trans.push_back (MachineTransition (0, 0, endState));
-    }
-  }
+  } else if (outChar.size() == 4) {
+    const int rotate4 = (fourWayKmerBits.rank(k) + 1) % 4;
+    const size_t i4 = rotate4, j4 = (rotate4 + 1) % 4, k4 = (rotate4 + 2) % 4, l4 = (rotate4 + 3) % 4;
+    ms.trans.push_back (MachineTransition (MachineBit0, MachineNull, kmerStateZero(kmer)));
+    ms.trans.push_back (MachineTransition (MachineBit1, MachineNull, kmerStateOne(kmer)));
 
-  for (size_t c = 0; c < controlWord.size(); ++c)
-    for (int step = 0; step < controlWordSteps[c] - 1; ++step) {
-      const auto& ckState = controlKmerState[c][step];
-      for (const auto& ks: ckState) {
-	const Kmer srcKmer = ks.first;
-	const State srcState = ks.second;
-	const Kmer destKmer = nextIntermediateKmer (srcKmer, c, step + 1);
-	machine.state[srcState].leftContext = kmerString(srcKmer,len);
-	machine.state[srcState].name = (isEndControlIndex(c) ? string("Bridge(End)") : (string("Bridge(") + controlChar(c) + ")")) + "#" + to_string(srcState);
-	machine.state[srcState].trans.push_back (controlTrans (srcState, destKmer, c, step + 1));
-      }
-    }
+    ms.trans.push_back (MachineTransition (MachineFlush, MachineNull, s));
 
-  machine.state[endState].name = "End#" + to_string(endState);
-  machine.state[endState].leftContext = buildDelayedMachine
-    ? (kmerSubstring(endControlWord(),1,len/2) + string(len/2,MachineWildContext))
-    : (controlWordAtEnd ? kmerString(endControlWord(),len) : string(len,MachineWildContext));
-  
-  if (buildDelayedMachine) {
-    for (Pos pos = 1; pos <= len/2; ++pos) {
-      const State s = endState - 1 - len/2 + pos;
-      MachineState& ms = machine.state[s];
-      ms.name = string("Unload(End)#") + to_string(s);
-      ms.leftContext = kmerSubstring(endControlWord(),1,len-pos) + string(pos,MachineWildContext);
-      if (pos < len/2)
-	ms.trans.push_back (MachineTransition (0, MachineWildContext, s + 1));
-      else
-	ms.trans.push_back (MachineTransition (0, 0, endState));
-    }
+    ms.trans.push_back (MachineTransition (MachineStrictQuat0, outChar[i4], outState[i4]));
+    ms.trans.push_back (MachineTransition (MachineStrictQuat1, outChar[j4], outState[j4]));
+    ms.trans.push_back (MachineTransition (MachineStrictQuat2, outChar[k4], outState[k4]));
+    ms.trans.push_back (MachineTransition (MachineStrictQuat3, outChar[l4], outState[l4]));
+  }
 
-    for (auto& ms: machine.state) {
-      ms.rightContext = string (ms.leftContext.begin() + len/2, ms.leftContext.end());
-      ms.leftContext.erase (ms.leftContext.begin() + len/2, ms.leftContext.end());
+  if (outChar.size() > 1) {
+    for (size_t c = 0; c < controlWord.size(); ++c) {
+      if (isSourceControlIndex(c))
+	continue;
+      ms.trans.push_back (controlTrans (s, controlWordPath[c].nextKmer (kmer, 0), c, 0));
     }
-
-    for (auto& ms: machine.state)
-      for (auto& t: ms.trans)
-	if (t.out)
-	  t.out = machine.state[t.dest].leftContext.back();
+    if (!controlWordAtEnd)
+      ms.trans.push_back (MachineTransition (MachineEOF, 0, endState));
   }
 
-  Assert (machine.state[0].trans.front().inputEmpty(), "First transition shouldn't have input");
-  machine.state[0].trans.front().in = MachineSOF;
-  
-  return machine;
+  return ms;
 }
 
 bool TransBuilder::isSourceControlIndex (size_t c) const {
@@ -460,7 +767,7 @@ char TransBuilder::controlChar (size_t nControlWord) const {
 MachineTransition TransBuilder::controlTrans (State srcState, Kmer destKmer, size_t nControlWord, size_t step) const {
   const State destState =
     (step == controlWordSteps[nControlWord] - 1 && destKmer == controlWord[nControlWord])
-    ? kmerState.at(destKmer)
+    ? kmerState(destKmer)
     : controlKmerState[nControlWord][step].at(destKmer);
   return MachineTransition (step == 0
 			    ? (isEndControlIndex(nControlWord) ? MachineEOF : controlChar(nControlWord))
@@ -526,15 +833,26 @@ bool TransBuilder::getNextControlWord() {
 		       + "+ differences from (" + to_string_join(controlWordString) + ")"))
 	      << endl);
 
-    list<Kmer> savedKmers;
-    for (auto kmer: kmers)
-      if (kmerValid[kmer])
-	savedKmers.push_back (kmer);
-    
+    // only the neighbourhoods of best and its reverse complement are affected,
+    // so dead-end pruning can start there; everything it invalidates goes on the undo log
+    const size_t undoMark = invalidatedKmers.size();
     sourceMotif.insert (bestMotif);
-    kmerValid[bestRevComp] = false;
+    deque<Kmer> worklist;
+    EdgeVector nbr;
+    getIncoming (best, nbr);
+    for (auto n: nbr)
+      queueDeadEndCandidate (n, worklist);
+    if (kmerValid[bestRevComp]) {
+      invalidateKmer (bestRevComp);
+      getIncoming (bestRevComp, nbr);
+      for (auto n: nbr)
+	queueDeadEndCandidate (n, worklist);
+      getOutgoing (bestRevComp, nbr);
+      for (auto n: nbr)
+	queueDeadEndCandidate (n, worklist);
+    }
 
-    pruneDeadEnds();
+    pruneDeadEnds (worklist);
     pruneUnreachable();
 
     bool broken = false;
@@ -568,8 +886,7 @@ bool TransBuilder::getNextControlWord() {
     // flag this word as unusable and restore previous state
     dist[bestIdx] = 0;
     sourceMotif.erase (bestMotif);
-    for (auto kmer: savedKmers)
-      kmerValid[kmer] = true;
+    restoreInvalidatedKmers (undoMark);
 
     LogThisAt(3,"Trying next option for control word #" << (cCurrent + 1) << endl);
   }
@@ -595,7 +912,9 @@ void TransBuilder::getControlWords() {
     startAndEndUseSameControlWord = true;
   }
   
+  invalidatedKmers.clear();
   Require (getNextControlWord(), "Ran out of control words");
+  invalidatedKmers.clear();
 
   if (controlWordAtEnd && (!startAndEndUseSameControlWord || !controlWordAtStart)) {
     const Kmer e = endControlWord();
@@ -603,7 +922,7 @@ void TransBuilder::getControlWords() {
     getOutgoing (e, out);
     for (auto n: out)
       if (kmerValid[n])
-	droppedEdge.insert (pair<Kmer,Kmer> (e, n));
+	dropEdge (e, n);
   }
   
   pruneDeadEnds();
@@ -614,7 +933,7 @@ void TransBuilder::getControlWords() {
     const Kmer controlKmer = controlWord[c];
     if (isSourceControlIndex(c)) {
       controlWordSteps.push_back (0);
-      controlWordPath.push_back (map<Kmer,list<Kmer> >());
+      controlWordPath.push_back (BridgePaths());
       controlWordIntermediates.push_back (vguard<set<Kmer> >());
     } else {
       const Pos controlSteps = stepsToReach (KmerLen (controlWord[c], len));
@@ -625,7 +944,7 @@ void TransBuilder::getControlWords() {
       for (auto kmer: kmers)
 	if (!controlWordAtEnd || kmer != endControlWord() || (startAndEndUseSameControlWord && controlWordAtStart)) {
 	  Pos step = 0;
-	  for (auto inter: controlWordPath[c].at(kmer)) {
+	  for (auto inter: controlWordPath[c].path (kmer)) {
 	    LogThisAt(9,"Adding " << kmerString(inter,len) << " at step " << step << " from " << kmerString(kmer,len) << " to control word #" << c << " (" << kmerString(controlWord[c],len) << ")" << endl);
 	    intermediates[step++].insert (inter);
 	  }
@@ -2,10 +2,13 @@
 #define BUILDER_INCLUDED
 
 #include <string>
+#include <thread>
+#include <functional>
 #include "vguard.h"
 #include "util.h"
 #include "kmer.h"
 #include "pattern.h"
+#include "rankbits.h"
 #include "trans.h"
 
 using namespace std;
@@ -17,6 +20,51 @@ typedef unsigned char EdgeFlags;
 #define ThymineFlag     (1 << ThymineBase)
 #define PurineFlags     (AdenineFlag | GuanineFlag)
 #define PyrimidineFlags (CytosineFlag | ThymineFlag)
+#define OutEdgeFlagsMask 0xf
+#define DroppedEdgeShift 4
+
+/* Paths of a fixed number of steps ending at a control word k-mer, found by breadth-first search backwards from it.
+   level[s] is the sorted list of k-mers that can be s steps along a path, and next[s][i] is the k-mer that follows level[s][i].
+   level[0] holds the path sources; level.back() holds only the control word.
+*/
+struct BridgePaths {
+  vguard<vguard<Kmer> > level, next;
+
+  BridgePaths (int steps = 0)
+    : level (steps + 1),
+      next (steps)
+  { }
+
+  inline int steps() const { return next.size(); }
+
+  inline Kmer nextKmer (Kmer kmer, int step) const {
+    const auto& l = level[step];
+    const auto iter = lower_bound (l.begin(), l.end(), kmer);
+    Assert (iter != l.end() && *iter == kmer, "No path from k-mer at step %d", step);
+    return next[step][iter - l.begin()];
+  }
+
+  // the k-mers visited after leaving src, ending with the control word
+  vguard<Kmer> path (Kmer src) const {
+    vguard<Kmer> p;
+    p.reserve (steps());
+    for (int step = 0; step < steps(); ++step)
+      p.push_back (src = nextKmer (src, step));
+    return p;
+  }
+};
+
+typedef pair<Kmer,Kmer> KmerStep;  // (src, dest)
+
+struct ImplicitMachine;
+
+// resource usage of one builder phase, for --profile-build
+struct BuildPhaseProfile {
+  string name;
+  double wallSeconds, cpuSeconds;  // CPU time is summed over all threads
+  long peakRssKb;  // peak resident set size of the process so far
+  map<string,unsigned long long> counts;
+};
 
 struct TransBuilder {
   static vguard<int> edgeFlagsToCountLookup;
@@ -27,44 +75,74 @@ struct TransBuilder {
 
   // config
   Pos maxTandemRepeatLen, invertedRepeatLen;
-  set<KmerLen> excludedMotif, excludedMotifRevComp;
-  set<KmerLen> sourceMotif;
+  MotifSet excludedMotif, excludedMotifRevComp;
+  MotifSet sourceMotif;
   bool keepDegenerates;
   size_t nControlWords;
   bool controlWordAtStart, controlWordAtEnd, startAndEndUseSameControlWord;
   bool buildDelayedMachine;
+  int nThreads;
+  string mappedDir;  // if nonempty, per-k-mer tables are memory-mapped temporary files in this directory
   
   // work variables
-  vguard<bool> kmerValid;
+  RankBitVector kmerValid;  // indexed by indexStates, after which it must not change
+  BitArray kmerQueued, kmerReached;
+  mutable BitArray kmerInFrontier;  // scratch for stepsToReach, allocated once and all false between calls
+  vguard<Kmer> invalidatedKmers;  // undo log for kmerValid, used to backtrack during control word search
   list<Kmer> kmers;
   vguard<Kmer> controlWord;
   vguard<string> controlWordString;
   vguard<Pos> controlWordSteps;
-  vguard<map<Kmer,list<Kmer> > > controlWordPath;
+  vguard<BridgePaths> controlWordPath;
   vguard<vguard<set<Kmer> > > controlWordIntermediates;
-  map<Kmer,EdgeFlags> kmerOutFlags;
-  set<pair<Kmer,Kmer> > droppedEdge;
+  MappedArray<EdgeFlags> kmerEdgeFlags;  // low 4 bits: outgoing edges of machine (set by buildEdges); high 4 bits: dropped outgoing edges
+  unsigned long long nDroppedEdges;
 
-  State nStates, firstNonControlState, endState;
-  map<Kmer,State> kmerState, kmerStateZero, kmerStateOne;
+  State nStates, firstControlState, firstSourceState, firstNonControlState, firstSplitState, firstBridgeState, endState;
+  // classes of valid k-mers, indexed by kmerIndex, so each holds one bit per valid k-mer rather than one per possible k-mer
+  RankBitVector sourceKmerBits, ordinaryKmerBits, twoWayKmerBits, threeWayKmerBits, fourWayKmerBits;
   vguard<vguard<map<Kmer,State> > > controlKmerState;
+  vguard<Kmer> bridgeKmer;  // k-mer for each bridge state, in state order
+  vguard<BuildPhaseProfile> buildProfile;
   
   TransBuilder (Pos len);
 
   void prepare();
+  void profilePhase (const char* name, const function<void()>& phase);
+  void writeBuildProfileJSON (ostream& out) const;
+  void allocKmerTables();
   void findCandidates();
+  void findCandidatesInRange (Kmer first, Kmer last, const KmerRepeatFilter& repeatFilter, bool explainRejects, vguard<Kmer>& found, ProgressLogger* plog) const;
   void pruneUnreachable();
   void pruneDeadEnds();
+  void pruneDeadEnds (deque<Kmer>& worklist);  // prunes k-mers with no incoming or outgoing edges, starting from worklist, until no more can be pruned
+  void restoreInvalidatedKmers (size_t undoMark);  // revalidates k-mers invalidated since invalidatedKmers had size undoMark
   void buildEdges();
   void indexStates();
 
+  void prepareMachine();
   Machine makeMachine();
+  ImplicitMachine makeImplicitMachine();  // the returned machine refers to this builder, which must outlive it
+
+  // synthesize a single state of the machine, after prepareMachine()
+  MachineState makeState (State s) const;
+  MachineState makeUndelayedState (State s) const;
+  MachineState makeKmerState (Kmer kmer, State s) const;
+  Kmer stateKmer (State s) const;  // for control word, source & ordinary k-mer states
+  void getKmerOutputs (Kmer kmer, vguard<char>& outChar, vguard<State>& outState) const;
+  bool startAndEndShareControlState() const;
+
+  // machine cache, keyed by a hash of the builder configuration and builderVersion
+  // bump builderVersion whenever a change to the builder changes the machine it builds, so stale cached machines are never served
+  static const int builderVersion = 1;
+  string configDescription() const;
+  string cacheFilename (const string& cacheDir) const;
+  Machine makeCachedMachine (const string& cacheDir, bool useCached = true);  // if useCached is false, rebuilds and overwrites any cached machine
   
   void assertKmersCorrect() const;
   
-  void doDFS (Kmer kmer, map<Kmer,Pos>& distance) const;
+  void doDFS (const vguard<Kmer>& roots, vguard<Kmer>& reached);  // sets kmerReached for every k-mer reached, and appends them to reached
 
-  set<Kmer> kmersEndingWith (KmerLen motif) const;
   Pos stepsToReach (KmerLen motif, int maxSteps = 64) const;
 
   void getControlWords();
@@ -75,27 +153,88 @@ struct TransBuilder {
   Kmer startControlWord() const;
   Kmer endControlWord() const;
   
-  map<Kmer,list<Kmer> > pathsTo (Kmer dest, int steps) const;
+  BridgePaths pathsTo (Kmer dest, int steps) const;
   MachineTransition controlTrans (State srcState, Kmer destKmer, size_t nControlWord, size_t step) const;
   Kmer nextIntermediateKmer (Kmer srcKmer, size_t nControlWord, size_t step) const;
   char controlChar (size_t nControlWord) const;
   
-  inline void pruneDeadEnds (Kmer kmer) {
-    EdgeVector in, out;
-    if (kmerValid[kmer] && !endsWithMotif(kmer,len,sourceMotif)) {
-      const int inCount = countIncoming(kmer,in), outCount = countOutgoing(kmer,out);
-      const bool prune = inCount == 0 || outCount == 0;
-      LogThisAt(9,(prune ? "Pruning" : "Keeping") << " " << kmerString(kmer,len) << " with " << inCount << " incoming and " << outCount << " outgoing edges" << endl);
-      if (prune) {
-	kmerValid[kmer] = 0;
-	for (auto kmerIn: in)
-	  pruneDeadEnds (kmerIn);
-	for (auto kmerOut: out)
-	  pruneDeadEnds (kmerOut);
+  // state numbering: control words in order, then source k-mers, then other k-mers, then Split0/Split1 states for k-mers with 3 or 4 outgoing edges
+  // position of a valid k-mer in ascending order of valid k-mers, after indexStates()
+  inline size_t kmerIndex (Kmer kmer) const { return kmerValid.rank (kmer); }
+
+  inline State kmerState (Kmer kmer) const {
+    if (kmerValid.test (kmer)) {
+      const size_t k = kmerIndex (kmer);
+      if (ordinaryKmerBits.test (k))
+	return firstNonControlState + ordinaryKmerBits.rank (k);
+      if (sourceKmerBits.test (k))
+	return firstSourceState + sourceKmerBits.rank (k);
+    }
+    const auto iter = find (controlWord.begin(), controlWord.end(), kmer);
+    Assert (iter != controlWord.end(), "No state for %s", kmerString(kmer,len).c_str());
+    return firstControlState + (iter - controlWord.begin());
+  }
+
+  inline State kmerStateZero (Kmer kmer) const {
+    const size_t k = kmerIndex (kmer);
+    Assert (kmerValid.test (kmer) && threeWayKmerBits.test (k), "No Split0 state for %s", kmerString(kmer,len).c_str());
+    return firstSplitState + threeWayKmerBits.rank (k) + fourWayKmerBits.rank (k);
+  }
+
+  inline State kmerStateOne (Kmer kmer) const {
+    Assert (kmerValid.test (kmer) && fourWayKmerBits.test (kmerIndex (kmer)), "No Split1 state for %s", kmerString(kmer,len).c_str());
+    return kmerStateZero (kmer) + 1;
+  }
+
+  inline void invalidateKmer (Kmer kmer) {
+    if (kmerValid[kmer]) {
+      kmerValid[kmer] = false;
+      invalidatedKmers.push_back (kmer);
+    }
+  }
+
+  inline void queueDeadEndCandidate (Kmer kmer, deque<Kmer>& worklist) {
+    if (kmerValid[kmer] && !kmerQueued[kmer]) {
+      kmerQueued[kmer] = true;
+      worklist.push_back (kmer);
+    }
+  }
+
+  // finds every step (src,dest) with dest in frontier and allowStep(src,dest) true, splitting the frontier across threads if it is large
+  template<class StepFilter>
+  void expandFrontier (const vguard<Kmer>& frontier, StepFilter allowStep, vguard<KmerStep>& kmerSteps) const {
+    const size_t minShardSize = 0x4000;
+    const size_t nShards = max ((size_t) 1, min ((size_t) nThreads, frontier.size() / minShardSize));
+    const size_t shardSize = frontier.size() / nShards + 1;
+    vguard<vguard<KmerStep> > shardSteps (nShards);
+    auto expandShard = [&] (size_t shard) {
+      EdgeVector in;
+      const size_t end = min (frontier.size(), (shard + 1) * shardSize);
+      for (size_t i = shard * shardSize; i < end; ++i) {
+	getIncoming (frontier[i], in);
+	for (auto src: in)
+	  if (allowStep (src, frontier[i]))
+	    shardSteps[shard].push_back (KmerStep (src, frontier[i]));
+      }
+    };
+    if (nShards == 1)
+      expandShard (0);
+    else {
+      list<thread> threads;
+      for (size_t shard = 0; shard < nShards; ++shard) {
+	threads.push_back (thread (expandShard, shard));
+	logger.nameLastThread (threads, "bfs");
+      }
+      for (auto& t: threads) {
+	t.join();
+	logger.eraseThreadName (t);
       }
     }
+    kmerSteps.clear();
+    for (const auto& ss: shardSteps)
+      kmerSteps.insert (kmerSteps.end(), ss.begin(), ss.end());
   }
- 
+
   inline void getOutgoing (Kmer kmer, EdgeVector& outgoing) const {
     Assert (outgoing.size() == 4, "oops");
     const Kmer prefix = (kmer << 2) & kmerMask(len);
@@ -110,13 +249,34 @@ struct TransBuilder {
       incoming[b] = prefix | (((Kmer) b) << shift);
   }
 
+  inline EdgeFlags kmerOutFlags (Kmer kmer) const {
+    return kmerEdgeFlags[kmer] & OutEdgeFlagsMask;
+  }
+
+  inline void setKmerOutFlags (Kmer kmer, EdgeFlags flags) {
+    kmerEdgeFlags[kmer] = (kmerEdgeFlags[kmer] & ~OutEdgeFlagsMask) | (flags & OutEdgeFlagsMask);
+  }
+
+  // the edge from src to dest is identified by the last base of dest
+  inline bool isDroppedEdge (Kmer src, Kmer dest) const {
+    return (kmerEdgeFlags[src] >> (DroppedEdgeShift + (dest & BaseMask))) & 1;
+  }
+
+  inline void dropEdge (Kmer src, Kmer dest) {
+    const EdgeFlags f = 1 << (DroppedEdgeShift + (dest & BaseMask));
+    if (!(kmerEdgeFlags[src] & f)) {
+      kmerEdgeFlags[src] |= f;
+      ++nDroppedEdges;
+    }
+  }
+
   inline EdgeFlags outgoingEdgeFlags (Kmer kmer, EdgeVector& outgoing) {
     getOutgoing (kmer, outgoing);
     EdgeFlags f = 0;
     for (size_t n = 0; n < 4; ++n)
       if (kmerValid[outgoing[n]]
 	  && !endsWithMotif(outgoing[n],len,sourceMotif)
-	  && !droppedEdge.count (pair<Kmer,Kmer> (kmer, outgoing[n])))
+	  && !isDroppedEdge (kmer, outgoing[n]))
 	f = f | (1 << n);
     return f;
   }
@@ -126,7 +286,7 @@ struct TransBuilder {
     EdgeFlags f = 0;
     for (size_t n = 0; n < 4; ++n)
       if (kmerValid[incoming[n]]
-	  && !droppedEdge.count (pair<Kmer,Kmer> (incoming[n], kmer)))
+	  && !isDroppedEdge (incoming[n], kmer))
 	f = f | (1 << n);
     return f;
   }
@@ -170,9 +330,28 @@ struct TransBuilder {
 	      << "edge to " << kmerString(out[e],len)
 	      << " from " << kmerString(src,len)
 	      << endl);
-    droppedEdge.insert (pair<Kmer,Kmer> (src, out[e]));
+    dropEdge (src, out[e]);
     return flags & (0xf ^ (1 << e));
   }
 };
 
+/* Machine whose states are synthesized on demand from the builder's k-mer tables, instead of being stored.
+   Provides the parts of the Machine interface used by Encoder and Decoder.
+   Each access to state[s] builds a new MachineState, so callers should hold on to it rather than look it up repeatedly.
+*/
+struct ImplicitMachine {
+  struct StateTable {
+    const TransBuilder& builder;
+    StateTable (const TransBuilder& builder) : builder (builder) { }
+    inline MachineState operator[] (State s) const { return builder.makeState (s); }
+    inline State size() const { return builder.nStates; }
+  };
+
+  StateTable state;
+
+  ImplicitMachine (const TransBuilder& builder) : state (builder) { }
+  inline State nStates() const { return state.size(); }
+  inline State startState() const { return 0; }
+};
+
 #endif /* BUILDER_INCLUDED */
@@ -0,0 +1,82 @@
+#ifndef CHUNKED_ENCODER_INCLUDED
+#define CHUNKED_ENCODER_INCLUDED
+
+#include <sstream>
+#include <thread>
+#include <list>
+#include <memory>
+#include "compiledencoder.h"
+#include "logger.h"
+
+/* Splits a stream into fixed-size blocks and encodes each block as an independent FASTA record,
+   from the machine's start state through EOF, so any record can be decoded on its own.
+   Blocks are read in batches; the blocks of a batch are encoded on nThreads threads, then written in order,
+   so memory use is bounded by the batch size rather than the stream length.
+   Record k (counting from 1) is named NAME:START-END, the 1-based byte range of its block.
+   If compiled is true, each thread keeps one EncoderTable for all of its blocks.
+*/
+template<class MachineType>
+void encodeChunks (const MachineType& machine, istream& in, ostream& out, size_t chunkSize, int nThreads, const string& name, bool rawSeqOutput, bool compiled) {
+  Require (chunkSize > 0, "Chunk size must be positive");
+  nThreads = max (nThreads, 1);
+  const size_t batchSize = 4 * nThreads;
+  vguard<unique_ptr<EncoderTable<MachineType> > > table;
+  for (int t = 0; t < nThreads; ++t)
+    table.push_back (unique_ptr<EncoderTable<MachineType> > (compiled ? new EncoderTable<MachineType> (machine) : NULL));
+
+  auto encodeChunk = [&] (const string& chunk, const string& seqname, string& record, int thread) {
+    ostringstream recordStream;
+    {
+      FastaWriter writer (recordStream, rawSeqOutput ? NULL : seqname.c_str());
+      if (compiled) {
+	CompiledEncoder<FastaWriter,MachineType> encoder (machine, writer, *table[thread]);
+	encoder.encodeString (chunk);
+      } else {
+	Encoder<FastaWriter,MachineType> encoder (machine, writer);
+	encoder.encodeString (chunk);
+      }
+    }
+    record = recordStream.str();
+  };
+
+  size_t bytesRead = 0, nChunks = 0;
+  vguard<string> chunk (batchSize), seqname (batchSize), record (batchSize);
+  while (in) {
+    size_t nBatch = 0;
+    for (; nBatch < batchSize && in; ++nBatch) {
+      chunk[nBatch].resize (chunkSize);
+      in.read (&chunk[nBatch][0], chunkSize);
+      chunk[nBatch].resize (in.gcount());
+      if (chunk[nBatch].empty())
+	break;
+      seqname[nBatch] = name + ":" + to_string(bytesRead + 1) + "-" + to_string(bytesRead + chunk[nBatch].size());
+      bytesRead += chunk[nBatch].size();
+    }
+    if (nBatch == 0)
+      break;
+    LogThisAt(4,"Encoding blocks " << nChunks + 1 << "-" << nChunks + nBatch << " (" << bytesRead << " bytes read)" << endl);
+    if (nThreads == 1)
+      for (size_t n = 0; n < nBatch; ++n)
+	encodeChunk (chunk[n], seqname[n], record[n], 0);
+    else {
+      list<thread> threads;
+      for (int t = 0; t < nThreads; ++t) {
+	threads.push_back (thread ([&, t] () {
+	      for (size_t n = t; n < nBatch; n += nThreads)
+		encodeChunk (chunk[n], seqname[n], record[n], t);
+	    }));
+	logger.nameLastThread (threads, "encode");
+      }
+      for (auto& t: threads) {
+	t.join();
+	logger.eraseThreadName (t);
+      }
+    }
+    for (size_t n = 0; n < nBatch; ++n)
+      out.write (record[n].data(), record[n].size());
+    nChunks += nBatch;
+  }
+  LogThisAt(3,"Encoded " << bytesRead << " bytes as " << plural (nChunks, "record") << endl);
+}
+
+#endif /* CHUNKED_ENCODER_INCLUDED */
@@ -0,0 +1,90 @@
+#ifndef CLOSURE_INCLUDED
+#define CLOSURE_INCLUDED
+
+#include <unordered_map>
+#include <algorithm>
+#include "trans.h"
+#include "logger.h"
+
+/* Null-transition closure of machine states, for Encoder and Decoder.
+   The closure of a state is every state that can be reached from it by following only "null" transitions
+   (as defined by the Traversal policy) and at which the engine must stop and wait for the next symbol,
+   together with the symbols queued along the way.
+   Each state's closure is computed the first time it is needed, then reused, so the engines
+   jump straight across null chains instead of iterating to a fixed point for every symbol.
+   The Traversal policy provides:
+     static bool follows (const MachineTransition&);  // true if the transition is followed without consuming a symbol
+     static char queued (const MachineTransition&);  // symbol to append to the queue, or MachineNull
+     template<class S> static bool stops (const S&);  // true if the engine waits in this state
+     static const char* engine, * queue;  // for error messages
+*/
+template<class MachineType, class Traversal>
+class NullClosure {
+public:
+  struct Step {
+    State dest;
+    size_t symbolOffset, nSymbols;
+  };
+
+private:
+  const MachineType& machine;
+  vguard<Step> step;
+  vguard<char> symbol;
+  unordered_map<State,pair<size_t,size_t> > stepRange;  // state -> (first, last) in step
+
+  void compute (State s) {
+    // closures are small, so a vector with linear search is faster than a map here
+    vguard<pair<State,string> > seen;
+    seen.push_back (make_pair (s, string()));
+    const size_t first = step.size();
+    for (size_t n = 0; n < seen.size(); ++n) {
+      const State state = seen[n].first;
+      const string str = seen[n].second;
+      const auto& ms = machine.state[state];
+      if (Traversal::stops (ms)) {
+	Step st;
+	st.dest = state;
+	st.symbolOffset = symbol.size();
+	st.nSymbols = str.size();
+	symbol.insert (symbol.end(), str.begin(), str.end());
+	step.push_back (st);
+      }
+      for (const auto& t: ms.trans)
+	if (Traversal::follows (t)) {
+	  string nextStr = str;
+	  const char c = Traversal::queued (t);
+	  if (c != MachineNull)
+	    nextStr.push_back (c);
+	  const auto iter = find_if (seen.begin(), seen.end(), [&] (const pair<State,string>& ss) { return ss.first == t.dest; });
+	  if (iter != seen.end())
+	    Assert (iter->second == nextStr,
+		    "%s error: state %s has two possible %s queues (%s, %s)",
+		    Traversal::engine, machine.state[t.dest].name.c_str(), Traversal::queue,
+		    iter->second.c_str(), nextStr.c_str());
+	  else
+	    seen.push_back (make_pair (t.dest, nextStr));
+	}
+    }
+    stepRange[s] = make_pair (first, step.size());
+    LogThisAt(9,"Null closure of " << machine.state[s].name << " has " << plural (step.size() - first, "stopping state") << endl);
+  }
+
+public:
+  NullClosure (const MachineType& machine) : machine (machine) { }
+
+  // the returned range is valid until the closure of a state not yet seen is requested
+  ConstRange<Step> operator[] (State s) {
+    auto iter = stepRange.find (s);
+    if (iter == stepRange.end()) {
+      compute (s);
+      iter = stepRange.find (s);
+    }
+    return ConstRange<Step> (step.data() + iter->second.first, step.data() + iter->second.second);
+  }
+
+  inline ConstRange<char> symbols (const Step& st) const {
+    return ConstRange<char> (symbol.data() + st.symbolOffset, symbol.data() + st.symbolOffset + st.nSymbols);
+  }
+};
+
+#endif /* CLOSURE_INCLUDED */
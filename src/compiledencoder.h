@@ -0,0 +1,176 @@
+#ifndef COMPILED_ENCODER_INCLUDED
+#define COMPILED_ENCODER_INCLUDED
+
+#include <unordered_map>
+#include <memory>
+#include "encoder.h"
+
+/* Table of byte-at-a-time encoder steps.
+   An encoder configuration is everything Encoder carries between bytes: the candidate states with their output queues,
+   and whether start-of-file has been sent.
+   For each (configuration, byte) pair, the table holds the bases emitted and the next configuration.
+   Entries are compiled on first use by running a scratch Encoder from the stored configuration, so the output is
+   the same as Encoder's by construction; after that, encoding the same byte from the same configuration is one lookup.
+*/
+template<class MachineType = Machine>
+class EncoderTable {
+public:
+  struct StringWriter {
+    string out;
+    void write (const char* buf, size_t n) { out.append (buf, n); }
+  };
+  typedef Encoder<StringWriter,MachineType> ScratchEncoder;
+  typedef typename ScratchEncoder::StateString StateString;
+  typedef unsigned int Config;
+
+  struct Step {
+    Config next;
+    unsigned int nFlushes;  // number of FLUSH symbols the encoder had to insert
+    size_t outOffset, outLen;
+  };
+
+private:
+  StringWriter scratchWriter;
+  ScratchEncoder scratch;
+  vguard<StateString> configState;
+  vguard<bool> configSentSOF;
+  unordered_map<string,Config> configIndex;
+  unordered_map<unsigned long long,Step> step;  // key is (config << 8) | byte
+  vguard<char> output;
+  size_t nHits, nMisses;
+
+  Config intern (const StateString& current, bool sentSOF) {
+    string key (1, sentSOF ? '1' : '0');
+    for (const auto& ss: current) {
+      key.append ((const char*) &ss.state, sizeof(State));
+      const unsigned int len = ss.len;
+      key.append ((const char*) &len, sizeof(len));
+      key.append (current.queue(ss), ss.len);
+    }
+    const auto iter = configIndex.find (key);
+    if (iter != configIndex.end())
+      return iter->second;
+    const Config c = configState.size();
+    configIndex[key] = c;
+    configState.push_back (current.compacted());
+    configSentSOF.push_back (sentSOF);
+    return c;
+  }
+
+public:
+  const Config start;
+
+  EncoderTable (const MachineType& machine, bool msb0 = false)
+    : scratch (machine, scratchWriter),
+      nHits (0),
+      nMisses (0),
+      start (intern (scratch.current, scratch.sentSOF))
+  {
+    scratch.msb0 = msb0;
+  }
+
+  ~EncoderTable() {
+    // stop the scratch encoder from sending EOF when it is destroyed
+    scratch.sentEOF = true;
+    scratch.current.clear();
+    LogThisAt(3,"Encoder table: " << configState.size() << " configurations, " << step.size() << " compiled steps, " << nHits << " hits, " << nMisses << " misses" << endl);
+  }
+
+  const Step& encodeByte (Config c, unsigned char byte) {
+    const unsigned long long key = (((unsigned long long) c) << 8) | byte;
+    const auto iter = step.find (key);
+    if (iter != step.end()) {
+      ++nHits;
+      for (unsigned int n = 0; n < iter->second.nFlushes; ++n)
+	Warn ("Sending FLUSH. Depending on the code, this may insert extra bits!");
+      return iter->second;
+    }
+    ++nMisses;
+    scratch.current = configState[c];
+    scratch.sentSOF = configSentSOF[c];
+    scratch.nFlushes = 0;
+    scratchWriter.out.clear();
+    scratch.encodeByte (byte);
+    Step s;
+    s.next = intern (scratch.current, scratch.sentSOF);
+    s.nFlushes = scratch.nFlushes;
+    s.outOffset = output.size();
+    s.outLen = scratchWriter.out.size();
+    output.insert (output.end(), scratchWriter.out.begin(), scratchWriter.out.end());
+    return step[key] = s;
+  }
+
+  inline const char* stepOutput (const Step& s) const { return output.data() + s.outOffset; }
+
+  // copies a configuration into an Encoder, e.g. so it can finish the stream
+  template<class Writer>
+  void restore (Config c, Encoder<Writer,MachineType>& encoder) const {
+    encoder.current = configState[c];
+    encoder.sentSOF = configSentSOF[c];
+  }
+};
+
+/* Encoder that looks up each byte in an EncoderTable, producing the same output as Encoder */
+template<class Writer, class MachineType = Machine>
+struct CompiledEncoder {
+  const MachineType& machine;
+  Writer& outs;
+  unique_ptr<EncoderTable<MachineType> > ownTable;
+  EncoderTable<MachineType>& table;
+  typename EncoderTable<MachineType>::Config config;
+  bool closed;
+
+  CompiledEncoder (const MachineType& machine, Writer& outs, bool msb0 = false)
+    : machine (machine),
+      outs (outs),
+      ownTable (new EncoderTable<MachineType> (machine, msb0)),
+      table (*ownTable),
+      config (table.start),
+      closed (false)
+  { }
+
+  // shares a table, e.g. between successive encoders on one thread
+  CompiledEncoder (const MachineType& machine, Writer& outs, EncoderTable<MachineType>& table)
+    : machine (machine),
+      outs (outs),
+      table (table),
+      config (table.start),
+      closed (false)
+  { }
+
+  ~CompiledEncoder() {
+    close();
+  }
+
+  // finishes the stream with an ordinary Encoder, which sends EOF and flushes the output queue
+  void close() {
+    if (!closed) {
+      Encoder<Writer,MachineType> encoder (machine, outs);
+      table.restore (config, encoder);
+      encoder.close();
+      closed = true;
+    }
+  }
+
+  void encodeByte (unsigned char byte) {
+    const auto& step = table.encodeByte (config, byte);
+    if (step.outLen)
+      outs.write (table.stepOutput (step), step.outLen);
+    config = step.next;
+  }
+
+  void encodeStream (istream& in) {
+    istreambuf_iterator<char> iter(in), iterEnd;
+    while (iter != iterEnd) {
+      encodeByte (*iter);
+      ++iter;
+    }
+  }
+
+  void encodeString (const string& s) {
+    for (auto c: s)
+      encodeByte (c);
+  }
+};
+
+#endif /* COMPILED_ENCODER_INCLUDED */
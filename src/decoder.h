@@ -3,21 +3,40 @@
 
 #include "trans.h"
 #include "logger.h"
+#include "closure.h"
+#include "statequeues.h"
 
-template<class Writer>
+// Decoder follows usable transitions that emit no output, queueing their input, and waits in states that emit output
+struct DecoderTraversal {
+  static bool isUsable (const MachineTransition& t) {
+    return t.in == MachineNull
+      || t.in == MachineBit0 || t.in == MachineBit1
+      || t.in == MachineEOF || t.in == MachineSOF
+      || Machine::isControl(t.in);
+  }
+  static bool follows (const MachineTransition& t) { return isUsable(t) && t.outputEmpty(); }
+  static char queued (const MachineTransition& t) { return t.in; }
+  template<class S> static bool stops (const S& ms) { return ms.isEnd() || ms.emitsOutput(); }
+  static constexpr const char* engine = "Decoder";
+  static constexpr const char* queue = "input";
+};
+
+template<class Writer, class MachineType = Machine>
 struct Decoder {
-  typedef map<State,deque<InputSymbol> > StateString;
-  typedef typename StateString::iterator StateStringIter;
+  typedef StateQueues StateString;
+  typedef StateQueues::Entry StateStringEntry;
   
-  const Machine& machine;
+  const MachineType& machine;
   Writer& outs;
-  StateString current;
+  NullClosure<MachineType,DecoderTraversal> closure;
+  StateString current, next;  // next is scratch space, kept to reuse its buffers
 
-  Decoder (const Machine& machine, Writer& outs)
+  Decoder (const MachineType& machine, Writer& outs)
     : machine(machine),
-      outs(outs)
+      outs(outs),
+      closure(machine)
   {
-    current[machine.startState()] = deque<InputSymbol>();
+    current.push (machine.startState(), NULL, 0);
     expand();
   }
 
@@ -28,16 +47,16 @@ struct Decoder {
   void close() {
     if (current.size()) {
       expand();
-      vguard<StateStringIter> ssIter;
-      for (StateStringIter ss = current.begin(); ss != current.end(); ++ss)
-	if (machine.state[ss->first].isEnd())
-	  ssIter.push_back (ss);
-      if (ssIter.size() == 1)
-	flush (ssIter.front());
-      else if (ssIter.size() > 1) {
-	Warn ("Decoder unresolved: %u possible end states", ssIter.size());
-	for (auto ss: ssIter)
-	  Warn ("State %s: input queue %s", machine.state[ss->first].name.c_str(), ss->second.empty() ? "empty" : to_string_join(ss->second,"").c_str());
+      vguard<size_t> endEntry;
+      for (size_t n = 0; n < current.size(); ++n)
+	if (machine.state[current.entry[n].state].isEnd())
+	  endEntry.push_back (n);
+      if (endEntry.size() == 1)
+	flush (current.entry[endEntry.front()]);
+      else if (endEntry.size() > 1) {
+	Warn ("Decoder unresolved: %u possible end states", endEntry.size());
+	for (auto n: endEntry)
+	  showQueue (current.entry[n]);
       } else if (current.size() > 1) {
 	Warn ("Decoder unresolved: %u possible states", current.size());
 	showQueue();
@@ -46,114 +65,71 @@ struct Decoder {
     }
   }
 
+  void showQueue (const StateStringEntry& ss) const {
+    Warn ("State %s: input queue %s", machine.state[ss.state].name.c_str(), ss.len == 0 ? "empty" : current.queueString(ss).c_str());
+  }
+
   void showQueue() const {
     for (const auto& ss: current)
-      Warn ("State %s: input queue %s", machine.state[ss.first].name.c_str(), ss.second.empty() ? "empty" : to_string_join(ss.second,"").c_str());
+      showQueue (ss);
   }
   
   void expand() {
-    StateString next, seen;
-    bool foundNew;
-    do {
-      foundNew = false;
-      for (const auto& ss: current) {
-	seen.insert (ss);
-	const State state = ss.first;
-	const auto& str = ss.second;
-	const MachineState& ms = machine.state[state];
-	LogThisAt(10,"Input queue for " << ms.name << " is " << (str.empty() ? string("empty") : string(str.begin(),str.end())) << endl);
-	if (ms.isEnd() || ms.emitsOutput())
-	  next[state] = str;
-      }
-      for (const auto& ss: current) {
-	const State state = ss.first;
-	const auto& str = ss.second;
-	const MachineState& ms = machine.state[state];
-	for (const auto& t: ms.trans)
-	  if (isUsable(t) && t.outputEmpty()) {
-	    auto nextStr = str;
-	    if (!t.inputEmpty())
-	      nextStr.push_back (t.in);
-	    if (seen.count (t.dest))
-	      Assert (seen.at(t.dest) == nextStr,
-		      "Decoder error: state %s has two possible input queues (%s, %s)",
-		      machine.state[t.dest].name.c_str(),
-		      to_string_join(seen.at(t.dest),"").c_str(),
-		      to_string_join(nextStr,"").c_str());
-	    else {
-	      next[t.dest] = nextStr;
-	      LogThisAt(9,"Transition " << ms.name
-			<< " -> " << machine.state[t.dest].name
-			<< (nextStr.empty() ? string() : (string(": input queue ") + to_string_join(nextStr,"")))
-			<< endl);
-	      foundNew = true;
-	    }
-	  }
+    next.clear();
+    for (const auto& ss: current)
+      for (const auto& step: closure[ss.state]) {
+	const auto sym = closure.symbols (step);
+	next.push (step.dest, current.queue(ss), ss.len, sym.begin(), sym.size());
       }
-      current.swap (next);
-      next.clear();
-    } while (foundNew);
+    next.template finish<DecoderTraversal> (machine);
+    if (LoggingThisAt(10))
+      for (const auto& ss: next)
+	LogThisAt(10,"Input queue for " << machine.state[ss.state].name << " is " << (ss.len == 0 ? string("empty") : next.queueString(ss)) << endl);
+    current.swap (next);
   }
 
   void write (const char* s, size_t len) {
-    char* buf = (char*) malloc (sizeof(char) * (len + 1));
-    for (size_t n = 0; n < len; ++n)
-      buf[n] = s[n];
-    buf[len] = '\0';
-    (void) outs.write (buf, len);
-    free (buf);
+    outs.write (s, len);
   }
   
-  void flush (StateStringIter ss) {
-    const string str (ss->second.begin(), ss->second.end());
-    if (str.size()) {
-      LogThisAt(9,"Flushing input queue: " << str << endl);
-      write (str.c_str(), str.size());
-      ss->second.clear();
+  void flush (StateStringEntry& ss) {
+    if (ss.len) {
+      LogThisAt(9,"Flushing input queue: " << current.queueString(ss) << endl);
+      write (current.queue(ss), ss.len);
+      ss.len = 0;
     }
   }
 
   static bool isUsable (const MachineTransition& t) {
-    return t.in == MachineNull
-      || t.in == MachineBit0 || t.in == MachineBit1
-      || t.in == MachineEOF || t.in == MachineSOF
-      || Machine::isControl(t.in);
+    return DecoderTraversal::isUsable (t);
   }
   
   void decodeSymbol (OutputSymbol outSym) {
     LogThisAt(8,"Decoding " << outSym << endl);
-    StateString next;
+    next.clear();
     for (const auto& ss: current) {
-      const State state = ss.first;
-      const auto& str = ss.second;
+      const State state = ss.state;
       for (const auto& t: machine.state[state].trans)
 	if (isUsable(t) && t.out == outSym) {
 	  const State nextState = t.dest;
-	  auto nextStr = str;
-	  if (!t.inputEmpty())
-	    nextStr.push_back (t.in);
-	  Assert (!next.count(nextState) || next.at(nextState) == nextStr,
-		  "Decoder error: state %s has two possible input queues (%s, %s)",
-		  machine.state[nextState].name.c_str(),
-		  to_string_join(next.at(nextState),"").c_str(),
-		  to_string_join(nextStr,"").c_str());
-	  next[nextState] = nextStr;
+	  next.push (nextState, current.queue(ss), ss.len, &t.in, t.inputEmpty() ? 0 : 1);
 	  LogThisAt(9,"Transition " << machine.state[state].name
 		    << " -> " << machine.state[nextState].name
 		    << ": "
-		    << (nextStr.empty() ? string() : (string("input queue ") + to_string_join(nextStr,"") + ", "))
+		    << (next.entry.back().len == 0 ? string() : (string("input queue ") + next.queueString(next.entry.back()) + ", "))
 		    << "output " << t.out
 		    << endl);
 	}
     }
     Assert (!next.empty(), "Can't decode '%c'", outSym);
+    next.template finish<DecoderTraversal> (machine);
     current.swap (next);
     expand();
     if (current.size() == 1) {
-      auto iter = current.begin();
-      const MachineState& ms = machine.state[iter->first];
+      auto& ss = current.entry.front();
+      const auto& ms = machine.state[ss.state];
       if (ms.exitsWithInput())
-	flush (iter);
+	flush (ss);
     } else
       shiftResolvedSymbols();
   }
@@ -164,12 +140,12 @@ struct Decoder {
       InputSymbol firstChar;
       for (const auto& ss: current) {
 	if (!foundQueue) {
-	  if ((queueNonempty = !ss.second.empty()))
-	    firstChar = ss.second[0];
+	  if ((queueNonempty = ss.len > 0))
+	    firstChar = *current.queue(ss);
 	  foundQueue = firstCharSame = true;
 	} else if (queueNonempty
-		   && (ss.second.empty()
-		       || firstChar != ss.second[0])) {
+		   && (ss.len == 0
+		       || firstChar != *current.queue(ss))) {
 	  firstCharSame = false;
 	  break;
 	}
@@ -177,8 +153,7 @@ struct Decoder {
       if (foundQueue && queueNonempty && firstCharSame) {
 	LogThisAt(9,"All input queues have '" << Machine::charToString(firstChar) << "' as first symbol; shifting" << endl);
 	write (&firstChar, 1);
-	for (auto& ss: current)
-	  ss.second.erase (ss.second.begin());
+	current.shift();
       } else
 	break;
     }
@@ -218,7 +193,7 @@ struct BinaryWriter {
     outbuf.clear();
   }
   
-  void write (char* buf, size_t n) {
+  void write (const char* buf, size_t n) {
     for (size_t i = 0; i < n; ++i) {
       const char c = buf[i];
       if (c == MachineBit0 || c == MachineBit1) {
@@ -0,0 +1,387 @@
+#ifndef DECODER_TABLE_INCLUDED
+#define DECODER_TABLE_INCLUDED
+
+#include <unordered_map>
+#include <memory>
+#include <fstream>
+#include <climits>
+#include <cstring>
+#include <unistd.h>
+#include "decoder.h"
+
+/* Determinized decoder: a table of Decoder configurations and the steps between them.
+   A configuration is the set of candidate states with their input queues, i.e. everything Decoder carries between bases,
+   so Decoder is doing subset construction on the fly. determinize() does it up front instead, by breadth-first search
+   from the start configuration, and records for each (configuration, base) the next configuration and the input symbols emitted.
+   Exact decoding is then one array lookup per base.
+   Each step is computed by running a scratch Decoder from the stored configuration, so the output is the same as Decoder's.
+   Steps beyond the configuration limit are compiled the first time they are needed.
+
+   The table can be saved next to the machine (--decoder-table) and reloaded; the file records a fingerprint of
+   the machine's transitions, and a table for a different machine is rejected.
+   Like the binary machine format, the file is only portable between hosts with the same byte order.
+*/
+template<class MachineType = Machine>
+class DecoderTable {
+public:
+  struct StringWriter {
+    string out;
+    void write (const char* buf, size_t n) { out.append (buf, n); }
+  };
+  typedef Decoder<StringWriter,MachineType> ScratchDecoder;
+  typedef uint32_t Config;
+  static const Config unknownConfig = UINT_MAX, deadConfig = UINT_MAX - 1;
+  static const Config start = 0;
+
+  struct Step {
+    Config next;
+    uint32_t outLen;
+    uint64_t outOffset;
+  };
+
+  struct Header {
+    char magic[8];
+    uint32_t version, byteOrder;
+    uint64_t fingerprint, nConfigs, nSymbols, nEntries, nQueueChars, nOutputChars;
+  };
+  static const uint32_t binaryVersion = 1;
+
+private:
+  const MachineType& machine;
+  StringWriter scratchWriter;
+  ScratchDecoder scratch;
+  uint64_t fingerprint;
+  string alphabet;  // bases that label usable transitions
+  int symbolIndex[256];  // base -> index in alphabet, or -1
+  // configuration c is the entries configEntry[configOffset[c] .. configOffset[c+1]), whose queues are in configQueue
+  vguard<uint64_t> configOffset;
+  vguard<StateQueues::Entry> configEntry;
+  vguard<char> configQueue;
+  unordered_map<string,Config> configIndex;  // built when first needed after loading a table
+  bool indexed;
+  vguard<Step> step;  // nConfigs() x alphabet.size()
+  vguard<char> output;
+  size_t nCompiled;
+
+  static const char* magic() { return "DNASTDT"; }
+  static uint32_t byteOrder() { return 0x01020304; }
+
+  static void appendKey (string& key, State state, const char* queue, size_t len) {
+    key.append ((const char*) &state, sizeof(State));
+    const unsigned int queueLen = len;
+    key.append ((const char*) &queueLen, sizeof(queueLen));
+    key.append (queue, len);
+  }
+
+  string configKey (Config c) const {
+    string key;
+    for (uint64_t e = configOffset[c]; e < configOffset[c+1]; ++e)
+      appendKey (key, configEntry[e].state, configQueue.data() + configEntry[e].offset, configEntry[e].len);
+    return key;
+  }
+
+  Config intern (const StateQueues& current) {
+    if (!indexed) {
+      for (Config c = 0; c < nConfigs(); ++c)
+	configIndex[configKey(c)] = c;
+      indexed = true;
+    }
+    string key;
+    for (const auto& ss: current)
+      appendKey (key, ss.state, current.queue(ss), ss.len);
+    const auto iter = configIndex.find (key);
+    if (iter != configIndex.end())
+      return iter->second;
+    const Config c = nConfigs();
+    Assert (c < deadConfig, "Too many decoder configurations");
+    configIndex[key] = c;
+    for (const auto& ss: current) {
+      StateQueues::Entry e = ss;
+      e.offset = configQueue.size();
+      configQueue.insert (configQueue.end(), current.queue(ss), current.queue(ss) + ss.len);
+      configEntry.push_back (e);
+    }
+    configOffset.push_back (configEntry.size());
+    Step unknown;
+    unknown.next = unknownConfig;
+    unknown.outLen = 0;
+    unknown.outOffset = 0;
+    step.insert (step.end(), alphabet.size(), unknown);
+    return c;
+  }
+
+  bool canDecode (Config c, OutputSymbol outSym) const {
+    for (uint64_t e = configOffset[c]; e < configOffset[c+1]; ++e)
+      for (const auto& t: machine.state[configEntry[e].state].trans)
+	if (ScratchDecoder::isUsable(t) && t.out == outSym)
+	  return true;
+    return false;
+  }
+
+  const Step& compile (Config c, size_t k) {
+    Step s;
+    s.outLen = 0;
+    s.outOffset = output.size();
+    if (!canDecode (c, alphabet[k]))
+      s.next = deadConfig;
+    else {
+      restore (c, scratch);
+      scratchWriter.out.clear();
+      scratch.decodeSymbol (alphabet[k]);
+      s.next = intern (scratch.current);
+      s.outLen = scratchWriter.out.size();
+      output.insert (output.end(), scratchWriter.out.begin(), scratchWriter.out.end());
+    }
+    ++nCompiled;
+    return step[c * alphabet.size() + k] = s;
+  }
+
+public:
+  DecoderTable (const MachineType& machine)
+    : machine (machine),
+      scratch (machine, scratchWriter),
+      fingerprint (0xcbf29ce484222325ULL),
+      configOffset (1, 0),
+      indexed (true),
+      nCompiled (0)
+  {
+    // hash of the transitions (FNV-1a over 64-bit words, with a shift to mix the high bits down), and the output alphabet
+    auto hash = [&] (uint64_t x) {
+      fingerprint = (fingerprint ^ x) * 0x100000001b3ULL;
+      fingerprint ^= fingerprint >> 32;
+    };
+    vguard<bool> seen (256, false);
+    hash (machine.nStates());
+    for (State s = 0; s < machine.nStates(); ++s)
+      for (const auto& t: machine.state[s].trans) {
+	hash (((uint64_t) (unsigned char) t.in << 8) | (unsigned char) t.out);
+	hash (t.dest);
+	if (ScratchDecoder::isUsable(t) && !t.outputEmpty())
+	  seen[(unsigned char) t.out] = true;
+      }
+    for (int c = 0; c < 256; ++c) {
+      symbolIndex[c] = seen[c] ? alphabet.size() : -1;
+      if (seen[c])
+	alphabet.push_back ((char) c);
+    }
+    intern (scratch.current);
+  }
+
+  ~DecoderTable() {
+    // stop the scratch decoder from flushing its queue when it is destroyed
+    scratch.current.clear();
+    LogThisAt(3,"Decoder table: " << nConfigs() << " configurations, " << nCompiled << " steps compiled" << endl);
+  }
+
+  inline size_t nConfigs() const { return configOffset.size() - 1; }
+
+  // compiles every step reachable from the start, until there are more than maxConfigs configurations; returns true if complete
+  bool determinize (size_t maxConfigs = 1 << 20) {
+    ProgressLog (plog, 3);
+    plog.initProgress ("Determinizing decoder");
+    Config c;
+    for (c = 0; c < nConfigs() && nConfigs() <= maxConfigs; ++c) {
+      plog.logProgress (c / (double) nConfigs(), "configuration %u/%u", c, (unsigned int) nConfigs());
+      for (size_t k = 0; k < alphabet.size(); ++k)
+	if (step[c * alphabet.size() + k].next == unknownConfig)
+	  compile (c, k);
+    }
+    const bool complete = c == nConfigs();
+    if (complete)
+      LogThisAt(2,"Determinized decoder has " << plural (nConfigs(), "configuration") << " over " << plural (alphabet.size(), "base") << endl);
+    else
+      Warn ("Stopped determinizing decoder at %u configurations; remaining steps will be compiled as they are needed", (unsigned int) nConfigs());
+    return complete;
+  }
+
+  // returns the step for a base, or NULL if the base can't be decoded from this configuration
+  inline const Step* decodeSymbol (Config c, OutputSymbol outSym) {
+    const int k = symbolIndex[(unsigned char) outSym];
+    if (k < 0)
+      return NULL;
+    const Step& s = step[c * alphabet.size() + k];
+    if (s.next == unknownConfig)
+      return compile(c,k).next == deadConfig ? NULL : &step[c * alphabet.size() + k];
+    return s.next == deadConfig ? NULL : &s;
+  }
+
+  inline const char* stepOutput (const Step& s) const { return output.data() + s.outOffset; }
+
+  // copies a configuration into a Decoder, e.g. so it can finish the stream
+  template<class Writer>
+  void restore (Config c, Decoder<Writer,MachineType>& decoder) const {
+    decoder.current.clear();
+    for (uint64_t e = configOffset[c]; e < configOffset[c+1]; ++e)
+      decoder.current.push (configEntry[e].state, configQueue.data() + configEntry[e].offset, configEntry[e].len);
+  }
+
+  void writeBinary (ostream& out) const {
+    Header h;
+    memset (&h, 0, sizeof(h));
+    memcpy (h.magic, magic(), sizeof(h.magic));
+    h.version = binaryVersion;
+    h.byteOrder = byteOrder();
+    h.fingerprint = fingerprint;
+    h.nConfigs = nConfigs();
+    h.nSymbols = alphabet.size();
+    h.nEntries = configEntry.size();
+    h.nQueueChars = configQueue.size();
+    h.nOutputChars = output.size();
+    out.write ((const char*) &h, sizeof(h));
+    out.write (alphabet.data(), alphabet.size());
+    out.write ((const char*) step.data(), step.size() * sizeof(Step));
+    out.write ((const char*) configOffset.data(), configOffset.size() * sizeof(uint64_t));
+    out.write ((const char*) configEntry.data(), configEntry.size() * sizeof(StateQueues::Entry));
+    out.write (configQueue.data(), configQueue.size());
+    out.write (output.data(), output.size());
+  }
+
+  // replaces the table with one read from a file; returns false, leaving the table unchanged, if the file is for a different machine
+  bool readBinary (istream& in, const char* source) {
+    Header h;
+    Require (in.read ((char*) &h, sizeof(h)) && memcmp (h.magic, magic(), sizeof(h.magic)) == 0,
+	     "%s is not a decoder table file", source);
+    Require (h.version == binaryVersion, "%s has decoder table format version %u; this program reads version %u", source, h.version, binaryVersion);
+    Require (h.byteOrder == byteOrder(), "%s was written on a host with a different byte order", source);
+    if (h.fingerprint != fingerprint || h.nSymbols != alphabet.size())
+      return false;
+    // check the header counts against the rest of the file before allocating anything
+    const streampos dataStart = in.tellg();
+    in.seekg (0, ios::end);
+    const streampos dataEnd = in.tellg();
+    in.seekg (dataStart);
+    Require (in && dataStart >= 0 && dataEnd >= dataStart, "Can't find the length of %s", source);
+    uint64_t nBytes = 0;
+    bool sizeOK = h.nConfigs < UINT64_MAX;
+    auto addBytes = [&] (uint64_t count, uint64_t size) {
+      if (count > (UINT64_MAX - nBytes) / size)
+	sizeOK = false;
+      else
+	nBytes += count * size;
+    };
+    addBytes (h.nSymbols, 1);
+    if (h.nSymbols && h.nConfigs > UINT64_MAX / h.nSymbols)
+      sizeOK = false;
+    else
+      addBytes (h.nConfigs * h.nSymbols, sizeof(Step));
+    if (sizeOK)
+      addBytes (h.nConfigs + 1, sizeof(uint64_t));
+    addBytes (h.nEntries, sizeof(StateQueues::Entry));
+    addBytes (h.nQueueChars, 1);
+    addBytes (h.nOutputChars, 1);
+    Require (sizeOK && nBytes == (uint64_t) (dataEnd - dataStart), "%s is corrupt", source);
+    string fileAlphabet (h.nSymbols, 0);
+    vguard<Step> fileStep (h.nConfigs * h.nSymbols);
+    vguard<uint64_t> fileOffset (h.nConfigs + 1);
+    vguard<StateQueues::Entry> fileEntry (h.nEntries);
+    vguard<char> fileQueue (h.nQueueChars), fileOutput (h.nOutputChars);
+    in.read (&fileAlphabet[0], fileAlphabet.size());
+    in.read ((char*) fileStep.data(), fileStep.size() * sizeof(Step));
+    in.read ((char*) fileOffset.data(), fileOffset.size() * sizeof(uint64_t));
+    in.read ((char*) fileEntry.data(), fileEntry.size() * sizeof(StateQueues::Entry));
+    in.read (fileQueue.data(), fileQueue.size());
+    in.read (fileOutput.data(), fileOutput.size());
+    Require (in && fileAlphabet == alphabet && h.nConfigs > 0 && fileOffset.front() == 0 && fileOffset.back() == h.nEntries,
+	     "%s is corrupt", source);
+    for (Config c = 0; c < h.nConfigs; ++c)
+      Require (fileOffset[c] <= fileOffset[c+1], "%s is corrupt", source);
+    for (const auto& e: fileEntry)
+      Require (e.state < machine.nStates() && e.offset + e.len <= h.nQueueChars, "%s is corrupt", source);
+    for (const auto& s: fileStep)
+      Require (s.next == unknownConfig || s.next == deadConfig || (s.next < h.nConfigs && s.outOffset + s.outLen <= h.nOutputChars),
+	       "%s is corrupt", source);
+    step.swap (fileStep);
+    configOffset.swap (fileOffset);
+    configEntry.swap (fileEntry);
+    configQueue.swap (fileQueue);
+    output.swap (fileOutput);
+    configIndex.clear();
+    indexed = false;
+    LogThisAt(2,"Loaded decoder table with " << plural (nConfigs(), "configuration") << " from " << source << endl);
+    return true;
+  }
+
+  /* loads the table from a file if it matches the machine; otherwise determinizes it and saves it there,
+     writing to a temporary file and renaming it, so concurrent jobs never see a partial table */
+  void loadOrSave (const string& filename) {
+    ifstream infile (filename, std::ios::binary);
+    if (infile) {
+      if (readBinary (infile, filename.c_str()))
+	return;
+      Warn ("Decoder table %s is for a different machine; rebuilding it", filename.c_str());
+    }
+    determinize();
+    const string tmpFilename = filename + "." + to_string(getpid()) + ".tmp";
+    ofstream outfile (tmpFilename, std::ios::binary);
+    if (outfile) {
+      writeBinary (outfile);
+      outfile.close();
+      if (outfile && rename (tmpFilename.c_str(), filename.c_str()) == 0) {
+	LogThisAt(2,"Saved decoder table to " << filename << endl);
+	return;
+      }
+      remove (tmpFilename.c_str());
+    }
+    Warn ("Couldn't save decoder table to %s", filename.c_str());
+  }
+};
+
+/* Decoder that looks up each base in a DecoderTable, producing the same output as Decoder */
+template<class Writer, class MachineType = Machine>
+struct CompiledDecoder {
+  const MachineType& machine;
+  Writer& outs;
+  unique_ptr<DecoderTable<MachineType> > ownTable;
+  DecoderTable<MachineType>& table;
+  typename DecoderTable<MachineType>::Config config;
+  bool closed;
+
+  CompiledDecoder (const MachineType& machine, Writer& outs)
+    : machine (machine),
+      outs (outs),
+      ownTable (new DecoderTable<MachineType> (machine)),
+      table (*ownTable),
+      config (table.start),
+      closed (false)
+  {
+    table.determinize();
+  }
+
+  // shares a table, e.g. between the records of a FASTA file
+  CompiledDecoder (const MachineType& machine, Writer& outs, DecoderTable<MachineType>& table)
+    : machine (machine),
+      outs (outs),
+      table (table),
+      config (table.start),
+      closed (false)
+  { }
+
+  ~CompiledDecoder() {
+    close();
+  }
+
+  // finishes the stream with an ordinary Decoder, which flushes the input queue of the end state
+  void close() {
+    if (!closed) {
+      Decoder<Writer,MachineType> decoder (machine, outs);
+      table.restore (config, decoder);
+      decoder.close();
+      closed = true;
+    }
+  }
+
+  void decodeSymbol (OutputSymbol outSym) {
+    const auto step = table.decodeSymbol (config, outSym);
+    Assert (step != NULL, "Can't decode '%c'", outSym);
+    if (step->outLen)
+      outs.write (table.stepOutput (*step), step->outLen);
+    config = step->next;
+  }
+
+  void decodeString (const string& seq) {
+    for (char c: seq)
+      decodeSymbol (toupper (c));
+  }
+};
+
+#endif /* DECODER_TABLE_INCLUDED */
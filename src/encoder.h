@@ -2,26 +2,41 @@
 #define ENCODER_INCLUDED
 
 #include "trans.h"
+#include "closure.h"
+#include "statequeues.h"
 
-template<class Writer>
+// Encoder follows transitions that need no input, queueing their output, and waits in states that take input
+struct EncoderTraversal {
+  static bool follows (const MachineTransition& t) { return t.inputEmpty(); }
+  static char queued (const MachineTransition& t) { return t.out; }
+  template<class S> static bool stops (const S& ms) { return ms.isEnd() || ms.exitsWithInput(); }
+  static constexpr const char* engine = "Encoder";
+  static constexpr const char* queue = "output";
+};
+
+template<class Writer, class MachineType = Machine>
 struct Encoder {
-  typedef map<State,deque<InputSymbol> > StateString;
-  typedef typename StateString::iterator StateStringIter;
+  typedef StateQueues StateString;
+  typedef StateQueues::Entry StateStringEntry;
 
-  const Machine& machine;
+  const MachineType& machine;  // Machine, FrozenMachine or ImplicitMachine
   Writer& outs;
-  StateString current;
+  NullClosure<MachineType,EncoderTraversal> closure;
+  StateString current, next;  // next is scratch space, kept to reuse its buffers
   bool sentSOF, sentEOF;
   bool msb0;  // set this to encode MSB first, instead of LSB first
+  size_t nFlushes;  // number of FLUSH symbols inserted because the next symbol couldn't be encoded
 
-  Encoder (const Machine& machine, Writer& outs)
+  Encoder (const MachineType& machine, Writer& outs)
     : machine(machine),
       outs(outs),
-      msb0(false),
+      closure(machine),
       sentSOF(false),
-      sentEOF(false)
+      sentEOF(false),
+      msb0(false),
+      nFlushes(0)
   {
-    current[machine.startState()] = deque<OutputSymbol>();
+    current.push (machine.startState(), NULL, 0);
     expand();
   }
 
@@ -35,16 +50,16 @@ struct Encoder {
 
     if (current.size()) {
       expand();
-      vguard<StateStringIter> ssIter;
-      for (StateStringIter ss = current.begin(); ss != current.end(); ++ss)
-	if (machine.state[ss->first].isEnd())
-	  ssIter.push_back (ss);
-      if (ssIter.size() == 1)
-	flush (ssIter.front());
-      else if (ssIter.size() > 1) {
-	Warn ("Encoder unresolved: %u possible end states", ssIter.size());
-	for (auto ss: ssIter)
-	  Warn ("State %s: output queue %s", machine.state[ss->first].name.c_str(), ss->second.empty() ? "empty" : to_string_join(ss->second,"").c_str());
+      vguard<size_t> endEntry;
+      for (size_t n = 0; n < current.size(); ++n)
+	if (machine.state[current.entry[n].state].isEnd())
+	  endEntry.push_back (n);
+      if (endEntry.size() == 1)
+	flush (current.entry[endEntry.front()]);
+      else if (endEntry.size() > 1) {
+	Warn ("Encoder unresolved: %u possible end states", endEntry.size());
+	for (auto n: endEntry)
+	  showQueue (current.entry[n]);
       } else if (current.size() > 1) {
 	Warn ("Encoder unresolved: %u possible states", current.size());
 	showQueue();
@@ -53,81 +68,49 @@ struct Encoder {
     }
   }
 
+  void showQueue (const StateStringEntry& ss) const {
+    Warn ("State %s: output queue %s", machine.state[ss.state].name.c_str(), ss.len == 0 ? "empty" : current.queueString(ss).c_str());
+  }
+
   void showQueue() const {
     for (const auto& ss: current)
-      Warn ("State %s: output queue %s", machine.state[ss.first].name.c_str(), ss.second.empty() ? "empty" : to_string_join(ss.second,"").c_str());
+      showQueue (ss);
   }
 
   bool atEnd() const {
-    return current.size() == 1 && machine.state[(*current.begin()).first].isEnd();
+    return current.size() == 1 && machine.state[current.entry.front().state].isEnd();
   }
 
   bool canEncodeSymbol (InputSymbol sym) const {
     for (const auto& ss: current)
-      if (machine.state[ss.first].transFor(sym) != NULL)
+      if (machine.state[ss.state].transFor(sym) != NULL)
 	return true;
     return false;
   }
   
   void expand() {
-    StateString next, seen;
-    bool foundNew;
-    do {
-      foundNew = false;
-      for (const auto& ss: current) {
-	seen.insert (ss);
-	const State state = ss.first;
-	const auto& str = ss.second;
-	const MachineState& ms = machine.state[state];
-	LogThisAt(10,"Output queue for " << ms.name << " is " << (str.empty() ? string("empty") : string(str.begin(),str.end())) << endl);
-	if (ms.isEnd() || ms.exitsWithInput())
-	  next[state] = str;
-      }
-      for (const auto& ss: current) {
-	const State state = ss.first;
-	const auto& str = ss.second;
-	const MachineState& ms = machine.state[state];
-	for (const auto& t: ms.trans)
-	  if (t.inputEmpty()) {
-	    auto nextStr = str;
-	    if (!t.outputEmpty())
-	      nextStr.push_back (t.out);
-	    if (seen.count (t.dest))
-	      Assert (seen.at(t.dest) == nextStr,
-		      "Encoder error: state %s has two possible output queues (%s, %s)",
-		      machine.state[t.dest].name.c_str(),
-		      to_string_join(seen.at(t.dest),"").c_str(),
-		      to_string_join(nextStr,"").c_str());
-	    else {
-	      next[t.dest] = nextStr;
-	      LogThisAt(9,"Transition " << ms.name
-			<< " -> " << machine.state[t.dest].name
-			<< (nextStr.empty() ? string() : (string(": output queue ") + to_string_join(nextStr,"")))
-			<< endl);
-	      foundNew = true;
-	    }
-	  }
+    next.clear();
+    for (const auto& ss: current)
+      for (const auto& step: closure[ss.state]) {
+	const auto sym = closure.symbols (step);
+	next.push (step.dest, current.queue(ss), ss.len, sym.begin(), sym.size());
       }
-      current.swap (next);
-      next.clear();
-    } while (foundNew);
+    next.template finish<EncoderTraversal> (machine);
+    if (LoggingThisAt(10))
+      for (const auto& ss: next)
+	LogThisAt(10,"Output queue for " << machine.state[ss.state].name << " is " << (ss.len == 0 ? string("empty") : next.queueString(ss)) << endl);
+    current.swap (next);
   }
   
   void write (const char* s, size_t len) {
-    char* buf = (char*) malloc (sizeof(char) * (len + 1));
-    for (size_t n = 0; n < len; ++n)
-      buf[n] = s[n];
-    buf[len] = '\0';
-    (void) outs.write (buf, len);
-    free (buf);
+    outs.write (s, len);
   }
 
-  void flush (StateStringIter ss) {
-    const string str (ss->second.begin(), ss->second.end());
-    if (str.size()) {
-      LogThisAt(9,"Flushing output queue: " << str << endl);
-      write (str.c_str(), str.size());
-      ss->second.clear();
+  void flush (StateStringEntry& ss) {
+    if (ss.len) {
+      LogThisAt(9,"Flushing output queue: " << current.queueString(ss) << endl);
+      write (current.queue(ss), ss.len);
+      ss.len = 0;
     }
   }
 
@@ -136,6 +119,7 @@ struct Encoder {
       encodeSymbol (MachineSOF);
     if (inSym != MachineFlush && !canEncodeSymbol(inSym)) {
 	Warn ("Sending FLUSH. Depending on the code, this may insert extra bits!");
+	++nFlushes;
 	encodeSymbol (MachineFlush);
     }
     if (!canEncodeSymbol(inSym))
@@ -146,38 +130,30 @@ struct Encoder {
     else if (inSym == MachineEOF)
       sentEOF = true;
 
-    StateString next;
+    next.clear();
     for (const auto& ss: current) {
-      const State state = ss.first;
-      const auto& str = ss.second;
+      const State state = ss.state;
       for (const auto& t: machine.state[state].trans)
 	if (t.in == inSym) {
 	  const State nextState = t.dest;
-	  auto nextStr = str;
-	  if (!t.outputEmpty())
-	    nextStr.push_back (t.out);
-	  Assert (!next.count(nextState) || next.at(nextState) == nextStr,
-		  "Encoder error: state %s has two possible output queues (%s, %s)",
-		  machine.state[nextState].name.c_str(),
-		  to_string_join(next.at(nextState),"").c_str(),
-		  to_string_join(nextStr,"").c_str());
-	  next[nextState] = nextStr;
+	  next.push (nextState, current.queue(ss), ss.len, &t.out, t.outputEmpty() ? 0 : 1);
 	  LogThisAt(9,"Transition " << machine.state[state].name
 		    << " -> " << machine.state[nextState].name
 		    << ": "
-		    << (nextStr.empty() ? string() : (string("output queue ") + to_string_join(nextStr,"") + ", "))
+		    << (next.entry.back().len == 0 ? string() : (string("output queue ") + next.queueString(next.entry.back()) + ", "))
 		    << "input " << t.in
 		    << endl);
 	}
     }
     Assert (!next.empty(), "Can't encode symbol '%c'", inSym);
+    next.template finish<EncoderTraversal> (machine);
     current.swap (next);
     expand();
     if (current.size() == 1) {
-      auto iter = current.begin();
-      const MachineState& ms = machine.state[iter->first];
+      auto& ss = current.entry.front();
+      const auto& ms = machine.state[ss.state];
       if (ms.emitsOutput())
-	flush (iter);
+	flush (ss);
     } else
       shiftResolvedSymbols();
   }
@@ -188,12 +164,12 @@ struct Encoder {
       OutputSymbol firstChar;
       for (const auto& ss: current) {
 	if (!foundQueue) {
-	  if ((queueNonempty = !ss.second.empty()))
-	    firstChar = ss.second[0];
+	  if ((queueNonempty = ss.len > 0))
+	    firstChar = *current.queue(ss);
 	  foundQueue = firstCharSame = true;
 	} else if (queueNonempty
-		   && (ss.second.empty()
-		       || firstChar != ss.second[0])) {
+		   && (ss.len == 0
+		       || firstChar != *current.queue(ss))) {
 	  firstCharSame = false;
 	  break;
 	}
@@ -201,8 +177,7 @@ struct Encoder {
       if (foundQueue && queueNonempty && firstCharSame) {
 	LogThisAt(9,"All output queues have '" << firstChar << "' as first symbol; shifting" << endl);
 	write (&firstChar, 1);
-	for (auto& ss: current)
-	  ss.second.erase (ss.second.begin());
+	current.shift();
       } else
 	break;
     }
@@ -242,31 +217,53 @@ struct Encoder {
   }
 };
 
+/* Writes FASTA through a large buffer, copying whole line segments at a time.
+   The stream is only written when the buffer fills, and only flushed when the writer is destroyed.
+*/
 struct FastaWriter {
+  static const size_t bufferSize = 1 << 16;
   ostream& outs;
   size_t col, colsPerLine;
+  string buffer;
   
   FastaWriter (ostream& outs, const char* seqname = "SEQ")
     : outs(outs),
       col(0),
       colsPerLine(seqname == NULL ? 0 : 50)
   {
-    if (seqname != NULL)
-      outs << ">" << seqname << endl;
+    buffer.reserve (bufferSize + colsPerLine + 1);
+    if (seqname != NULL) {
+      buffer.push_back ('>');
+      buffer.append (seqname);
+      buffer.push_back ('\n');
+    }
   }
 
   ~FastaWriter() {
     if (col > 0)
-      outs << endl;
+      buffer.push_back ('\n');
+    writeBuffer();
+    outs.flush();
+  }
+
+  void writeBuffer() {
+    outs.write (buffer.data(), buffer.size());
+    buffer.clear();
   }
   
-  void write (char* buf, size_t n) {
-    for (size_t i = 0; i < n; ++i) {
-      outs << buf[i];
-      if (++col >= colsPerLine && colsPerLine > 0) {
-	outs << endl;
+  void write (const char* buf, size_t n) {
+    while (n > 0) {
+      const size_t segLen = colsPerLine ? min (n, colsPerLine - col) : n;
+      buffer.append (buf, segLen);
+      buf += segLen;
+      n -= segLen;
+      col += segLen;
+      if (col == colsPerLine) {
+	buffer.push_back ('\n');
 	col = 0;
       }
+      if (buffer.size() >= bufferSize)
+	writeBuffer();
     }
   }
 };
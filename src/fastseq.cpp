@@ -109,41 +109,62 @@ void writeFastqSeqs (ostream& out, const vguard<FastSeq>& fastSeqs) {
     s.writeFastq (out);
 }
 
+// reuses the strings' storage when a FastSeq is read into repeatedly
 void initFastSeq (FastSeq& seq, kseq_t* ks) {
-  if (ks->name.l)
-    seq.name = string(ks->name.s);
-  if (ks->seq.l)
-    seq.seq = string(ks->seq.s);
-  if (ks->comment.l)
-    seq.comment = string(ks->comment.s);
-  if (ks->qual.l && ks->qual.l == ks->seq.l)
-    seq.qual = string(ks->qual.s);
+  auto init = [] (string& str, const kstring_t& kstr, bool valid) {
+    if (valid && kstr.l)
+      str.assign (kstr.s, kstr.l);
+    else
+      str.clear();
+  };
+  init (seq.name, ks->name, true);
+  init (seq.seq, ks->seq, true);
+  init (seq.comment, ks->comment, true);
+  init (seq.qual, ks->qual, ks->qual.l == ks->seq.l);
+}
+
+FastSeqReader::FastSeqReader (const char* filename)
+  : filename (filename),
+    nRead (0)
+{
+  fp = gzopen (filename, "r");
+  Require (fp != Z_NULL, "Couldn't open %s", filename);
+  ks = kseq_init (fp);
 }
 
-vguard<FastSeq> readFastSeqs (const char* filename) {
-  vguard<FastSeq> seqs;
+FastSeqReader::~FastSeqReader() {
+  kseq_destroy ((kseq_t*) ks);
+  gzclose (fp);
 
-  gzFile fp = gzopen(filename, "r");
-  Require (fp != Z_NULL, "Couldn't open %s", filename);
+  LogThisAt(3, "Read " << plural(nRead,"sequence") << " from " << filename << endl);
+
+  if (nRead == 0)
+    Warn ("Couldn't read any sequences from %s", filename.c_str());
+}
 
-  kseq_t *ks = kseq_init(fp);
-  while (true) {
-    if (kseq_read(ks) == -1)
-      break;
+bool FastSeqReader::read (FastSeq& seq) {
+  if (kseq_read ((kseq_t*) ks) < 0)
+    return false;
+  initFastSeq (seq, (kseq_t*) ks);
+  ++nRead;
+  return true;
+}
 
-    FastSeq seq;
-    initFastSeq (seq, ks);
+size_t FastSeqReader::readBatch (vguard<FastSeq>& batch, size_t maxSeqs) {
+  batch.resize (maxSeqs);
+  size_t n = 0;
+  while (n < maxSeqs && read (batch[n]))
+    ++n;
+  batch.resize (n);
+  return n;
+}
 
+vguard<FastSeq> readFastSeqs (const char* filename) {
+  vguard<FastSeq> seqs;
+  FastSeqReader reader (filename);
+  FastSeq seq;
+  while (reader.read (seq))
     seqs.push_back (seq);
-  }
-  kseq_destroy (ks);
-  gzclose (fp);
-
-  LogThisAt(3, "Read " << plural(seqs.size(),"sequence") << " from " << filename << endl);
-  
-  if (seqs.empty())
-    Warn ("Couldn't read any sequences from %s", filename);
-  
   return seqs;
 }
 
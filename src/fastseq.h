@@ -51,6 +51,22 @@ struct FastSeq {
   void writeFastq (ostream& out) const;
 };
 
+/* Reads a FASTA or FASTQ file (which may be gzipped) one record at a time, so files larger than memory can be processed */
+class FastSeqReader {
+public:
+  FastSeqReader (const char* filename);
+  ~FastSeqReader();
+  bool read (FastSeq& seq);  // returns false at end of file
+  size_t readBatch (vguard<FastSeq>& batch, size_t maxSeqs);  // replaces contents of batch with up to maxSeqs records; returns number read
+private:
+  const string filename;
+  gzFile fp;
+  void* ks;  // kseq_t*, which is only defined in fastseq.cpp
+  size_t nRead;
+  FastSeqReader (const FastSeqReader&) = delete;
+  FastSeqReader& operator= (const FastSeqReader&) = delete;
+};
+
 vguard<FastSeq> readFastSeqs (const char* filename);
 void writeFastaSeqs (ostream& out, const vguard<FastSeq>& fastSeqs);
 void writeFastqSeqs (ostream& out, const vguard<FastSeq>& fastSeqs);
@@ -2,6 +2,7 @@
 #define KMER_INCLUDED
 
 #include <cmath>
+#include <cstring>
 #include <string>
 #include "vguard.h"
 #include "util.h"
@@ -49,7 +50,7 @@ inline Base getBase (Kmer kmer, Pos pos) {
 
 inline Kmer setBase (Kmer kmer, Pos pos, Base base) {
   const int shift = (pos - 1) << 1;
-  return (kmer & (((Kmer) -1) ^ (BaseMask << shift))) | (((Kmer) base) << shift);
+  return (kmer & (((Kmer) -1) ^ (((Kmer) BaseMask) << shift))) | (((Kmer) base) << shift);
 }
 
 inline Base complementBase (Base b) {
@@ -73,7 +74,7 @@ inline string kmerString (KmerLen kl) {
 
 inline Kmer stringToKmer (const string& s) {
   Kmer kmer = 0;
-  for (Pos i = 0; i <= s.size(); ++i)
+  for (Pos i = 0; i < s.size(); ++i)
     kmer = setBase (kmer, s.size() - i, charToBase (s[i]));
   return kmer;
 }
@@ -0,0 +1,175 @@
+#ifndef MAPPEDARRAY_INCLUDED
+#define MAPPEDARRAY_INCLUDED
+
+#include <string>
+#include <type_traits>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "vguard.h"
+#include "util.h"
+
+/* Fixed-size zero-initialized array held in a memory mapping.
+   With no directory, the mapping is anonymous, so untouched pages cost nothing.
+   With a directory, the array is backed by an unlinked temporary file there, so the OS can page it out to disk.
+   This allows per-k-mer tables for k-mer lengths whose 4^len entries would not fit in RAM.
+*/
+template<typename T>
+class MappedArray {
+  static_assert (std::is_trivial<T>::value, "MappedArray elements must be trivial, as they are zero-initialized");
+  T* ptr;
+  size_t n;
+
+  void release() {
+    if (ptr)
+      munmap (ptr, n * sizeof(T));
+    ptr = NULL;
+    n = 0;
+  }
+
+public:
+  typedef T value_type;
+
+  MappedArray() : ptr (NULL), n (0) { }
+
+  MappedArray (size_t n, const std::string& dir = std::string())
+    : ptr (NULL), n (n)
+  {
+    if (n == 0)
+      return;
+    const size_t bytes = n * sizeof(T);
+    void* p;
+    if (dir.empty())
+      p = mmap (NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    else {
+      const std::string tmpl = dir + "/dnastore-XXXXXX";
+      vguard<char> path (tmpl.begin(), tmpl.end());
+      path.push_back ('\0');
+      const int fd = mkstemp (path.data());
+      if (fd < 0)
+	Fail ("Couldn't create temporary file in %s", dir.c_str());
+      unlink (path.data());  // storage is freed when the mapping goes away
+      if (ftruncate (fd, bytes) != 0) {
+	close (fd);
+	Fail ("Couldn't extend temporary file in %s to %llu bytes", dir.c_str(), (unsigned long long) bytes);
+      }
+      p = mmap (NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      close (fd);
+    }
+    if (p == MAP_FAILED)
+      Fail ("Couldn't map %llu bytes%s%s", (unsigned long long) bytes, dir.empty() ? "" : " in ", dir.c_str());
+    ptr = (T*) p;
+  }
+
+  MappedArray (const MappedArray&) = delete;
+  MappedArray& operator= (const MappedArray&) = delete;
+
+  MappedArray (MappedArray&& m) : ptr (m.ptr), n (m.n) {
+    m.ptr = NULL;
+    m.n = 0;
+  }
+
+  MappedArray& operator= (MappedArray&& m) {
+    if (this != &m) {
+      release();
+      ptr = m.ptr;
+      n = m.n;
+      m.ptr = NULL;
+      m.n = 0;
+    }
+    return *this;
+  }
+
+  ~MappedArray() { release(); }
+
+  inline size_t size() const { return n; }
+  inline bool empty() const { return n == 0; }
+  inline T* begin() { return ptr; }
+  inline T* end() { return ptr + n; }
+  inline const T* begin() const { return ptr; }
+  inline const T* end() const { return ptr + n; }
+
+  inline T& operator[] (size_t i) {
+#ifdef USE_VECTOR_GUARDS
+    if (i >= n) {
+      std::cerr << "mapped array overflow: element " << i << ", size is " << n << std::endl;
+      printStackTrace();
+      throw;
+    }
+#endif  /* USE_VECTOR_GUARDS */
+    return ptr[i];
+  }
+
+  inline const T& operator[] (size_t i) const {
+#ifdef USE_VECTOR_GUARDS
+    if (i >= n) {
+      std::cerr << "const mapped array overflow: element " << i << ", size is " << n << std::endl;
+      printStackTrace();
+      throw;
+    }
+#endif  /* USE_VECTOR_GUARDS */
+    return ptr[i];
+  }
+};
+
+/* Bit array in a MappedArray of 64-bit words.
+   Indexing works like vector<bool>, so it can stand in for vguard<bool>.
+*/
+class BitArray {
+public:
+  typedef unsigned long long Word;
+  static const size_t wordBits = 64;
+
+  struct reference {
+    Word& w;
+    const Word mask;
+    reference (Word& w, Word mask) : w (w), mask (mask) { }
+    inline operator bool() const { return (w & mask) != 0; }
+    inline reference& operator= (bool b) {
+      if (b)
+	w |= mask;
+      else
+	w &= ~mask;
+      return *this;
+    }
+    inline reference& operator= (const reference& r) { return *this = (bool) r; }
+  };
+
+protected:
+  size_t nBits;
+  MappedArray<Word> word;
+
+public:
+  BitArray (size_t nBits = 0, const std::string& dir = std::string())
+    : nBits (nBits),
+      word ((nBits + wordBits - 1) / wordBits, dir)
+  { }
+
+  inline size_t size() const { return nBits; }
+  inline const MappedArray<Word>& words() const { return word; }
+
+  inline bool test (size_t i) const {
+    return (word[i / wordBits] >> (i % wordBits)) & 1;
+  }
+
+  inline void set (size_t i) {
+    word[i / wordBits] |= ((Word) 1) << (i % wordBits);
+  }
+
+  inline void reset (size_t i) {
+    word[i / wordBits] &= ~(((Word) 1) << (i % wordBits));
+  }
+
+  inline bool operator[] (size_t i) const { return test (i); }
+  inline reference operator[] (size_t i) {
+    return reference (word[i / wordBits], ((Word) 1) << (i % wordBits));
+  }
+
+  size_t popcount() const {
+    size_t c = 0;
+    for (auto w: word)
+      c += __builtin_popcountll (w);
+    return c;
+  }
+};
+
+#endif /* MAPPEDARRAY_INCLUDED */
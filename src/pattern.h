@@ -2,6 +2,7 @@
 #define PATTERN_INCLUDED
 
 #include <set>
+#include <unordered_set>
 #include "kmer.h"
 #include "logger.h"
 
@@ -14,11 +15,86 @@ inline bool endsWithMotif (Kmer seq, Pos len, const KmerLen& kl, const char* des
   return false;
 }
 
-inline bool endsWithMotif (Kmer seq, Pos len, const set<KmerLen>& motif, const char* desc = NULL) {
-  for (const auto& kl: motif)
-    if (endsWithMotif(seq,len,kl,desc))
-      return true;
-  return false;
+/* Set of motifs, compiled for suffix queries.
+   Motifs are bucketed by length, so testing whether a k-mer ends with any motif takes one probe per distinct motif length.
+   Short motif lengths use a bit table indexed by the suffix; longer ones use a hash set.
+*/
+#define MaxMotifBitTableLen 10
+
+struct MotifSet {
+  typedef set<KmerLen>::const_iterator const_iterator;
+
+  struct LengthTable {
+    Pos len;
+    Kmer mask;
+    size_t nMotifs;
+    vguard<bool> bits;
+    unordered_set<Kmer> hash;
+    LengthTable (Pos len)
+      : len (len),
+	mask (kmerMask (len)),
+	nMotifs (0),
+	bits (len <= MaxMotifBitTableLen ? (mask + 1) : 0, false)
+    { }
+    inline bool contains (Kmer suffix) const {
+      return bits.size() ? bits[suffix] : (hash.count (suffix) > 0);
+    }
+  };
+
+  set<KmerLen> motif;
+  vguard<LengthTable> table;  // sorted by length
+
+  const_iterator begin() const { return motif.begin(); }
+  const_iterator end() const { return motif.end(); }
+  size_t size() const { return motif.size(); }
+  bool empty() const { return motif.empty(); }
+  size_t count (const KmerLen& kl) const { return motif.count (kl); }
+
+  bool insert (const KmerLen& kl) {
+    if (!motif.insert(kl).second)
+      return false;
+    auto iter = table.begin();
+    while (iter != table.end() && iter->len < kl.len)
+      ++iter;
+    if (iter == table.end() || iter->len != kl.len)
+      iter = table.insert (iter, LengthTable (kl.len));
+    if (iter->bits.size())
+      iter->bits[kl.kmer] = true;
+    else
+      iter->hash.insert (kl.kmer);
+    ++iter->nMotifs;
+    return true;
+  }
+
+  size_t erase (const KmerLen& kl) {
+    if (!motif.erase(kl))
+      return 0;
+    auto iter = table.begin();
+    while (iter->len != kl.len)
+      ++iter;
+    if (iter->bits.size())
+      iter->bits[kl.kmer] = false;
+    else
+      iter->hash.erase (kl.kmer);
+    if (--iter->nMotifs == 0)
+      table.erase (iter);
+    return 1;
+  }
+
+  // returns the shortest motif that seq ends with, or NULL
+  inline const LengthTable* suffixTable (Kmer seq) const {
+    for (const auto& lt: table)
+      if (lt.contains (seq & lt.mask))
+	return &lt;
+    return NULL;
+  }
+};
+
+inline bool endsWithMotif (Kmer seq, Pos len, const MotifSet& motif, const char* desc = NULL) {
+  const MotifSet::LengthTable* lt = motif.suffixTable (seq);
+  if (lt && desc)
+    (void) endsWithMotif (seq, len, KmerLen (seq & lt->mask, lt->len), desc);
+  return lt != NULL;
 }
 
 inline bool hasExactTandemRepeat (Kmer seq, Pos len, Pos maxRepeatLen) {
@@ -64,4 +140,101 @@ inline bool hasExactNonlocalInvertedRepeat (Kmer seq, Pos len, Pos repeatLen, Po
   return false;
 }
 
+/* Word-parallel repeat filter.
+   Gives the same answers as hasExactTandemRepeat, hasExactLocalInvertedRepeat & hasExactNonlocalInvertedRepeat,
+   but tests every position of the k-mer at once, using XOR/AND masks over the 2-bit packed representation.
+   Each base gets one indicator bit (the low bit of its 2-bit slot).
+*/
+#define KmerBaseLowBits 0x5555555555555555ULL
+
+inline Kmer kmerBaseRangeMask (Pos first, Pos last) {  // indicator bits for bases first..last (1-based, inclusive)
+  // clamp to 1..32 so that kmerMask is only ever asked for a shift within the word
+  if (first < 1)
+    first = 1;
+  if (last > 32)
+    last = 32;
+  if (first > last)
+    return 0;
+  const Kmer hi = last == 32 ? ~(Kmer) 0 : kmerMask(last);
+  const Kmer lo = first == 1 ? 0 : kmerMask(first-1);
+  return (hi ^ lo) & KmerBaseLowBits;
+}
+
+inline Kmer kmerBaseEqualMask (Kmer x, Kmer y) {  // indicator bits for bases where x and y are equal
+  const Kmer d = x ^ y;
+  return ~(d | (d >> 1)) & KmerBaseLowBits;
+}
+
+inline Kmer kmerBaseComplementMask (Kmer x, Kmer y) {  // indicator bits for bases where x and y are complementary
+  const Kmer d = x ^ y;
+  return d & (d >> 1) & KmerBaseLowBits;
+}
+
+struct KmerRepeatFilter {
+  const Pos len, maxTandemRepeatLen, minLocalInvRepLen, maxLocalInvRepLen, nonlocalInvRepLen, minNonlocalSeparation;
+  vguard<Kmer> tandemRange, localInvRepRange, nonlocalInvRepRange;
+
+  KmerRepeatFilter (Pos len, Pos maxTandemRepeatLen, Pos minLocalInvRepLen, Pos maxLocalInvRepLen, Pos nonlocalInvRepLen, Pos minNonlocalSeparation)
+    : len (len),
+      maxTandemRepeatLen (maxTandemRepeatLen),
+      minLocalInvRepLen (minLocalInvRepLen),
+      maxLocalInvRepLen (maxLocalInvRepLen),
+      nonlocalInvRepLen (nonlocalInvRepLen),
+      minNonlocalSeparation (minNonlocalSeparation)
+  {
+    // tandem repeat of length r: first copy can start at bases 1..len-2r+1
+    for (Pos r = 0; r <= maxTandemRepeatLen; ++r)
+      tandemRange.push_back (kmerBaseRangeMask (1, len - 2*r + 1));
+    // local inverted repeat of length r: innermost left base can be at r..len-r
+    for (Pos r = 0; r <= maxLocalInvRepLen; ++r)
+      localInvRepRange.push_back (kmerBaseRangeMask (r, len - r));
+    // nonlocal inverted repeat with innermost pair separated by g: innermost left base can be at R..len-g-R+1
+    for (Pos g = 0; g < len; ++g)
+      nonlocalInvRepRange.push_back (kmerBaseRangeMask (nonlocalInvRepLen, len - g - nonlocalInvRepLen + 1));
+  }
+
+  inline bool hasTandemRepeat (Kmer seq) const {
+    for (Pos r = 1; r <= maxTandemRepeatLen && 2*r <= len; ++r) {
+      const Kmer same = kmerBaseEqualMask (seq, seq >> (r << 1));
+      Kmer run = same;
+      for (Pos k = 1; k < r && run; ++k)
+	run &= same >> (k << 1);
+      if (run & tandemRange[r])
+	return true;
+    }
+    return false;
+  }
+
+  inline bool hasLocalInvertedRepeat (Kmer seq) const {
+    // stem of a length-r hairpin with zero loop pairs base c-k with base c+k+1, for k=0..r-1
+    Kmer stem = kmerBaseRangeMask (1, len);
+    for (Pos r = 1; r <= maxLocalInvRepLen && 2*r <= len && stem; ++r) {
+      const Pos k = r - 1, gap = 2*k + 1;
+      stem &= kmerBaseComplementMask (seq, seq >> (gap << 1)) << (k << 1);
+      if (r >= minLocalInvRepLen && (stem & localInvRepRange[r]))
+	return true;
+    }
+    return false;
+  }
+
+  inline bool hasNonlocalInvertedRepeat (Kmer seq) const {
+    const Pos R = nonlocalInvRepLen;
+    if (R <= 0)
+      return false;
+    // stem of length R with innermost pair separated by g pairs base a-k with base a+g+k, for k=0..R-1
+    for (Pos g = minNonlocalSeparation + 1; g + 2*R - 1 <= len; ++g) {
+      Kmer stem = nonlocalInvRepRange[g];
+      for (Pos k = 0; k < R && stem; ++k)
+	stem &= kmerBaseComplementMask (seq, seq >> ((g + 2*k) << 1)) << (k << 1);
+      if (stem)
+	return true;
+    }
+    return false;
+  }
+
+  inline bool hasRepeat (Kmer seq) const {
+    return hasTandemRepeat(seq) || hasLocalInvertedRepeat(seq) || hasNonlocalInvertedRepeat(seq);
+  }
+};
+
 #endif /* PATTERN_INCLUDED */
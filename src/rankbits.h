@@ -0,0 +1,64 @@
+#ifndef RANKBITS_INCLUDED
+#define RANKBITS_INCLUDED
+
+#include <algorithm>
+#include "vguard.h"
+#include "mappedarray.h"
+
+/* Bit vector with constant-time rank queries.
+   rank(i) is the number of set bits at positions strictly less than i.
+   A 64-bit running count is stored for every block of 8 words, i.e. 1/8 bit of overhead per bit.
+   Bits must all be set before calling buildIndex(); rank() is undefined until then.
+*/
+struct RankBitVector : BitArray {
+  static const size_t blockWords = 8;
+
+  vguard<Word> blockRank;
+
+  RankBitVector (size_t nBits = 0, const std::string& dir = std::string())
+    : BitArray (nBits, dir)
+  { }
+
+  void buildIndex() {
+    blockRank.clear();
+    blockRank.reserve (word.size() / blockWords + 1);
+    Word r = 0;
+    for (size_t w = 0; w < word.size(); ++w) {
+      if (w % blockWords == 0)
+	blockRank.push_back (r);
+      r += __builtin_popcountll (word[w]);
+    }
+    blockRank.push_back (r);
+  }
+
+  inline size_t rank (size_t i) const {
+    const size_t w = i / wordBits, b = w / blockWords;
+    size_t r = blockRank[b];
+    for (size_t v = b * blockWords; v < w; ++v)
+      r += __builtin_popcountll (word[v]);
+    const size_t bit = i % wordBits;
+    if (bit)
+      r += __builtin_popcountll (word[w] & ((((Word) 1) << bit) - 1));
+    return r;
+  }
+
+  inline size_t count() const {
+    return blockRank.empty() ? 0 : blockRank.back();
+  }
+
+  // select(j) is the position of the set bit with rank j, i.e. the inverse of rank()
+  size_t select (size_t j) const {
+    Assert (j < count(), "select(%llu) out of range", (unsigned long long) j);
+    size_t b = upper_bound (blockRank.begin(), blockRank.end(), (Word) j) - blockRank.begin() - 1;
+    j -= blockRank[b];
+    size_t w = b * blockWords;
+    for (size_t c; (c = __builtin_popcountll (word[w])) <= j; ++w)
+      j -= c;
+    Word bits = word[w];
+    for (; j > 0; --j)
+      bits &= bits - 1;
+    return w * wordBits + __builtin_ctzll (bits);
+  }
+};
+
+#endif /* RANKBITS_INCLUDED */
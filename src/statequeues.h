@@ -0,0 +1,92 @@
+#ifndef STATE_QUEUES_INCLUDED
+#define STATE_QUEUES_INCLUDED
+
+#include <algorithm>
+#include "trans.h"
+#include "logger.h"
+
+/* Candidate states of Encoder or Decoder, each with its queue of symbols that are not yet written.
+   The entries are a small vector sorted by state, and each queue is a slice of one shared symbol buffer.
+   The engines build each new set into a second StateQueues and swap, so once both buffers have grown
+   to the working size, stepping through a symbol does no allocation.
+   Shifting a symbol that every queue agrees on just advances each slice.
+*/
+class StateQueues {
+public:
+  struct Entry {
+    State state;
+    size_t offset, len;
+    bool operator< (const Entry& e) const { return state < e.state; }
+  };
+
+  vguard<Entry> entry;
+  vguard<char> symbol;
+
+  inline size_t size() const { return entry.size(); }
+  inline bool empty() const { return entry.empty(); }
+  inline vguard<Entry>::iterator begin() { return entry.begin(); }
+  inline vguard<Entry>::iterator end() { return entry.end(); }
+  inline vguard<Entry>::const_iterator begin() const { return entry.begin(); }
+  inline vguard<Entry>::const_iterator end() const { return entry.end(); }
+
+  void clear() {
+    entry.clear();
+    symbol.clear();
+  }
+
+  void swap (StateQueues& sq) {
+    entry.swap (sq.entry);
+    symbol.swap (sq.symbol);
+  }
+
+  inline const char* queue (const Entry& e) const { return symbol.data() + e.offset; }
+  inline string queueString (const Entry& e) const { return string (queue(e), e.len); }
+
+  // adds a state whose queue is the given queue followed by the given extra symbols
+  void push (State state, const char* q, size_t qLen, const char* extra = NULL, size_t nExtra = 0) {
+    Entry e;
+    e.state = state;
+    e.offset = symbol.size();
+    e.len = qLen + nExtra;
+    symbol.insert (symbol.end(), q, q + qLen);
+    symbol.insert (symbol.end(), extra, extra + nExtra);
+    entry.push_back (e);
+  }
+
+  /* sorts the entries by state and merges duplicates, which must have the same queue.
+     Traversal supplies the engine and queue names for the error message, as for NullClosure */
+  template<class Traversal, class MachineType>
+  void finish (const MachineType& machine) {
+    if (entry.size() < 2)
+      return;
+    sort (entry.begin(), entry.end());
+    size_t n = 0;
+    for (size_t m = 1; m < entry.size(); ++m)
+      if (entry[m].state == entry[n].state)
+	Assert (entry[m].len == entry[n].len && equal (queue(entry[m]), queue(entry[m]) + entry[m].len, queue(entry[n])),
+		"%s error: state %s has two possible %s queues (%s, %s)",
+		Traversal::engine, machine.state[entry[n].state].name.c_str(), Traversal::queue,
+		queueString(entry[n]).c_str(), queueString(entry[m]).c_str());
+      else
+	entry[++n] = entry[m];
+    entry.resize (n + 1);
+  }
+
+  // drops the first symbol of every queue
+  void shift() {
+    for (auto& e: entry) {
+      ++e.offset;
+      --e.len;
+    }
+  }
+
+  // copy holding only the live parts of the symbol buffer
+  StateQueues compacted() const {
+    StateQueues sq;
+    for (const auto& e: entry)
+      sq.push (e.state, queue(e), e.len);
+    return sq;
+  }
+};
+
+#endif /* STATE_QUEUES_INCLUDED */
@@ -1,5 +1,12 @@
 #include <iomanip>
 #include <fstream>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "trans.h"
 #include "logger.h"
 #include "jsonutil.h"
@@ -151,6 +158,196 @@ const MachineTransition& MachineState::next() const {
   return trans.front();
 }
 
+// binary machine file layout: Header, then each array below padded to a multiple of 8 bytes
+static const char frozenMachineMagic[8] = { 'D', 'N', 'A', 'S', 'T', 'M', 'B', '\0' };
+static const uint32_t frozenMachineByteOrder = 0x01020304;
+
+static inline size_t paddedBytes (size_t bytes) {
+  return (bytes + 7) & ~(size_t) 7;
+}
+
+// returns 0 if the counts are too large for the total to fit in a size_t, e.g. in a corrupt file
+size_t FrozenMachine::Header::totalBytes() const {
+  size_t total = sizeof(Header);
+  bool fits = nStates < UINT64_MAX;
+  auto add = [&] (uint64_t count, size_t size) {
+    if (total > SIZE_MAX - 7 || count > (SIZE_MAX - 7 - total) / size)
+      fits = false;
+    else
+      total += paddedBytes (count * size);
+  };
+  add (nTransitions, sizeof(MachineTransition));
+  for (int n = 0; n < 4 && fits; ++n)
+    add (nStates + 1, sizeof(uint64_t));
+  add (nameChars, 1);
+  add (leftContextChars, 1);
+  add (rightContextChars, 1);
+  return fits ? total : 0;
+}
+
+FrozenMachine::FrozenMachine (const Machine& machine)
+  : state (*this), mappedData (NULL), mappedBytes (0)
+{
+  Header h;
+  memset (&h, 0, sizeof(h));
+  memcpy (h.magic, frozenMachineMagic, sizeof(h.magic));
+  h.version = binaryVersion;
+  h.byteOrder = frozenMachineByteOrder;
+  h.transitionBytes = sizeof(MachineTransition);
+  h.nStates = machine.nStates();
+  for (const auto& ms: machine.state) {
+    h.nTransitions += ms.trans.size();
+    h.nameChars += ms.name.size() + 1;
+    h.leftContextChars += ms.leftContext.size() + 1;
+    h.rightContextChars += ms.rightContext.size() + 1;
+  }
+
+  // fill a zeroed block, so padding bytes written by writeBinary are deterministic
+  const size_t bytes = h.totalBytes();
+  ownedData.resize (bytes / sizeof(uint64_t), 0);
+  char* data = (char*) ownedData.data();
+  memcpy (data, &h, sizeof(h));
+  attach (data, bytes, "frozen machine");
+
+  MachineTransition* t = (MachineTransition*) transition;
+  uint64_t* offset = (uint64_t*) transOffset;
+  for (const auto& ms: machine.state) {
+    offset[1] = offset[0] + ms.trans.size();
+    ++offset;
+    for (const auto& mt: ms.trans) {
+      t->in = mt.in;
+      t->out = mt.out;
+      t->dest = mt.dest;
+      ++t;
+    }
+  }
+  auto pack = [&] (PackedStrings& ps, string MachineState::* field) {
+    char* chars = (char*) ps.chars;
+    uint64_t* offset = (uint64_t*) ps.offset;
+    for (const auto& ms: machine.state) {
+      const string& str = ms.*field;
+      copy (str.begin(), str.end(), chars + offset[0]);
+      offset[1] = offset[0] + str.size() + 1;
+      ++offset;
+    }
+  };
+  pack (name, &MachineState::name);
+  pack (leftContext, &MachineState::leftContext);
+  pack (rightContext, &MachineState::rightContext);
+}
+
+FrozenMachine::FrozenMachine (const char* binaryFilename)
+  : state (*this), mappedData (NULL), mappedBytes (0)
+{
+  const int fd = open (binaryFilename, O_RDONLY);
+  if (fd < 0)
+    Fail ("File not found: %s", binaryFilename);
+  struct stat st;
+  if (fstat (fd, &st) != 0 || st.st_size < (off_t) sizeof(Header)) {
+    close (fd);
+    Fail ("%s is too short to be a binary machine file", binaryFilename);
+  }
+  mappedBytes = st.st_size;
+  mappedData = mmap (NULL, mappedBytes, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (mappedData == MAP_FAILED) {
+    mappedData = NULL;
+    Fail ("Couldn't map %s", binaryFilename);
+  }
+  LogThisAt(3,"Mapped " << mappedBytes << "-byte binary machine file " << binaryFilename << endl);
+  attach ((const char*) mappedData, mappedBytes, binaryFilename);
+}
+
+FrozenMachine::~FrozenMachine() {
+  if (mappedData)
+    munmap (mappedData, mappedBytes);
+}
+
+// The header, offsets, string terminators and transition destinations are all checked, so a corrupt file can't send the codecs out of bounds
+void FrozenMachine::attach (const char* data, size_t bytes, const char* source) {
+  header = (const Header*) data;
+  const Header& h = *header;
+  Require (memcmp (h.magic, frozenMachineMagic, sizeof(h.magic)) == 0, "%s is not a binary machine file", source);
+  Require (h.version == binaryVersion, "%s has binary machine format version %u; this program reads version %u", source, h.version, binaryVersion);
+  Require (h.byteOrder == frozenMachineByteOrder && h.transitionBytes == sizeof(MachineTransition),
+	   "%s was written on a host with a different byte order or structure layout", source);
+  Require (h.nStates > 0, "%s has no states", source);
+  Require (h.totalBytes() > 0, "%s is corrupt", source);
+  Require (h.totalBytes() == bytes, "%s is %llu bytes, but its header implies %llu bytes", source, (unsigned long long) bytes, (unsigned long long) h.totalBytes());
+
+  const char* next = data + sizeof(Header);
+  auto take = [&] (size_t bytes) {
+    const char* p = next;
+    next += paddedBytes (bytes);
+    return p;
+  };
+  const size_t offsetBytes = (h.nStates + 1) * sizeof(uint64_t);
+  transition = (const MachineTransition*) take (h.nTransitions * sizeof(MachineTransition));
+  transOffset = (const uint64_t*) take (offsetBytes);
+  name.offset = (const uint64_t*) take (offsetBytes);
+  leftContext.offset = (const uint64_t*) take (offsetBytes);
+  rightContext.offset = (const uint64_t*) take (offsetBytes);
+  name.chars = take (h.nameChars);
+  leftContext.chars = take (h.leftContextChars);
+  rightContext.chars = take (h.rightContextChars);
+
+  if (!ownedData.empty())
+    return;  // still being filled
+  // each state's transitions must lie within the array, and each string must be nonempty, to hold its NUL
+  Require (transOffset[0] == 0 && transOffset[h.nStates] == h.nTransitions, "%s is corrupt", source);
+  for (State s = 0; s < h.nStates; ++s)
+    Require (transOffset[s] <= transOffset[s+1], "%s is corrupt", source);
+  for (uint64_t t = 0; t < h.nTransitions; ++t)
+    Require (transition[t].dest < h.nStates, "%s is corrupt: transition %llu goes to state %llu, but there are only %llu states", source, (unsigned long long) t, (unsigned long long) transition[t].dest, (unsigned long long) h.nStates);
+  auto checkStrings = [&] (const PackedStrings& ps, uint64_t nChars) {
+    Require (ps.offset[0] == 0 && ps.offset[h.nStates] == nChars, "%s is corrupt", source);
+    for (State s = 0; s < h.nStates; ++s)
+      Require (ps.offset[s] < ps.offset[s+1] && ps.chars[ps.offset[s+1] - 1] == 0, "%s is corrupt", source);
+  };
+  checkStrings (name, h.nameChars);
+  checkStrings (leftContext, h.leftContextChars);
+  checkStrings (rightContext, h.rightContextChars);
+}
+
+void FrozenMachine::writeBinary (ostream& out) const {
+  out.write ((const char*) header, header->totalBytes());
+}
+
+// write to a temporary file & rename, so a failed or interrupted save never leaves a truncated machine behind
+void FrozenMachine::saveBinary (const string& filename) const {
+  const string tmpFilename = filename + "." + to_string(getpid()) + ".tmp";
+  ofstream outfile (tmpFilename, std::ios::binary);
+  if (outfile) {
+    writeBinary (outfile);
+    outfile.close();
+    if (outfile && rename (tmpFilename.c_str(), filename.c_str()) == 0) {
+      LogThisAt(2,"Saved binary machine to " << filename << endl);
+      return;
+    }
+    remove (tmpFilename.c_str());
+  }
+  Fail ("Couldn't write binary machine to %s", filename.c_str());
+}
+
+Machine FrozenMachine::thaw() const {
+  Machine machine;
+  machine.state.resize (nStates());
+  for (State s = 0; s < nStates(); ++s) {
+    const FrozenMachineState fs = state[s];
+    MachineState& ms = machine.state[s];
+    ms.name = fs.name;
+    ms.leftContext = fs.leftContext;
+    ms.rightContext = fs.rightContext;
+    ms.trans.insert (ms.trans.end(), fs.trans.begin(), fs.trans.end());
+  }
+  return machine;
+}
+
+State FrozenMachine::startState() const {
+  Assert (nStates() > 0, "Machine has no states");
+  return 0;
+}
+
 State Machine::nStates() const {
   return state.size();
 }
@@ -304,98 +501,130 @@ string Machine::inputDescriptionTable() const {
   return machineTokenLookup.tokenDescriptionTable (inputAlphabet (MachineAllInputFlags));
 }
 
-map<InputSymbol,double> Machine::expectedBasesPerInputSymbol (const char* symbols) const {
-  const size_t len = maxLeftContext() + maxRightContext();
-  const size_t burnInSteps = len*4, simSteps = len*4;
-  map<State,double> current;
-  size_t nSources = 0;
-  for (State s = 0; s < nStates(); ++s)
-    if (state[s].exitsWithInput (symbols)) {
-      current[s] = 1;
-      ++nSources;
-    }
-  Assert (nSources > 0, "Couldn't find any input states");
-  for (auto& ps: current)
-    ps.second /= (double) nSources;
+/* Each input symbol (other than EOF) is taken with equal probability from any state that accepts it.
+   This defines a Markov chain over the states where the machine waits for input.
+   Its stationary distribution is found by iterating the lazy chain (x + xP)/2, which has the same fixed point but also converges
+   when P is periodic, renormalizing each step so that mass lost to end states doesn't drain the distribution.
+   The transition matrix is stored transposed in compressed sparse row form, so each thread can pull into its own range of states.
+*/
+map<InputSymbol,double> Machine::expectedBasesPerInputSymbol (const char* symbols, int nThreads) const {
   const string alph (symbols);
-  map<char,vguard<double> > eb;
-
-  auto logCurrent = [&](int logLevel) -> void {
-    double pTot = 0;
-    for (auto& ps: current) {
-      LogThisAt(logLevel,"P(" << state[ps.first].name << ") = " << ps.second << endl);
-      pTot += ps.second;
+  const State n = nStates();
+  const double tolerance = 1e-12;
+  const size_t maxIterations = 100000;
+
+  // splits [0,n) into one contiguous range per thread, if there is enough work to make threads worthwhile
+  auto forEachRange = [&] (function<void(State,State)> f) {
+    const size_t nRanges = max ((State) 1, min ((State) nThreads, n / 0x10000));
+    if (nRanges == 1)
+      f (0, n);
+    else {
+      list<thread> threads;
+      for (size_t r = 0; r < nRanges; ++r)
+	threads.push_back (thread (f, n * r / nRanges, n * (r + 1) / nRanges));
+      for (auto& t: threads)
+	t.join();
     }
-    LogThisAt(logLevel+1,"Total probability is " << pTot << endl);
   };
-  
-  auto evolve = [&]() -> void {
-    logCurrent(5);
-    map<State,double> next;
-    map<char,double> bases;
-    for (const auto& ps: current) {
-      const MachineState& ms = state[ps.first];
-      const double p = ps.second;
-
-      map<char,const MachineTransition*> transFor;
-      double nt = 0;
-      for (char c: alph) {
-	auto t = ms.transFor(c);
-	if (t) {
-	  transFor[c] = t;
-	  if (c != MachineEOF)
-	    ++nt;
-	}
-      }
 
-      double ptot = 0;
-      for (const auto& ct: transFor) {
-	const char c = ct.first;
-	auto t = ct.second;
-	set<State> seen;
-	State s;
-	while (true) {
-	  if (t->out)
-	    bases[c] += p;
-	  s = t->dest;
-	  if (seen.count(s))  // guard against infinite loops
-	    break;
-	  seen.insert(s);
-	  if (state[s].exitsWithInput() || state[s].isEnd())
-	    break;
-	  Assert (state[s].isDeterministic(), "Non-deterministic state without inputs: %s", state[s].name.c_str());
-	  t = &state[s].next();
-	}
-	if (c != MachineEOF) {
-	  LogThisAt(7,"P(" << ms.name << "->" << state[s].name << ")=" << (p/nt) << endl);
-	  next[s] += p / nt;
-	  ptot += p / nt;
+  // follow each symbol's transition, and any deterministic chain after it, to the next waiting state
+  vguard<State> nEdges (n, 0);
+  vguard<map<char,State> > edgeDest (n);
+  vguard<map<char,double> > edgeBases (n);
+  forEachRange ([&] (State first, State last) {
+      for (State src = first; src < last; ++src)
+	for (char c: alph) {
+	  auto t = state[src].transFor(c);
+	  if (!t)
+	    continue;
+	  double nBases = 0;
+	  set<State> seen;
+	  State s;
+	  while (true) {
+	    if (t->out)
+	      ++nBases;
+	    s = t->dest;
+	    if (seen.count(s))  // guard against infinite loops
+	      break;
+	    seen.insert(s);
+	    if (state[s].exitsWithInput() || state[s].isEnd())
+	      break;
+	    Assert (state[s].isDeterministic(), "Non-deterministic state without inputs: %s", state[s].name.c_str());
+	    t = &state[s].next();
+	  }
+	  edgeBases[src][c] = nBases;
+	  if (c != MachineEOF) {
+	    edgeDest[src][c] = s;
+	    ++nEdges[src];
+	  }
 	}
+    });
+
+  vguard<size_t> inOffset (n + 1, 0);
+  for (State src = 0; src < n; ++src)
+    for (const auto& cd: edgeDest[src])
+      ++inOffset[cd.second + 1];
+  for (State s = 0; s < n; ++s)
+    inOffset[s+1] += inOffset[s];
+  vguard<State> inSource (inOffset.back());
+  vguard<double> inProb (inOffset.back());
+  {
+    vguard<size_t> next (inOffset);
+    for (State src = 0; src < n; ++src)
+      for (const auto& cd: edgeDest[src]) {
+	inSource[next[cd.second]] = src;
+	inProb[next[cd.second]++] = 1. / (double) nEdges[src];
       }
-      LogThisAt(8,"Total outgoing transition probability from state " << ms.name << " is " << ptot << "; state probability is " << p << endl);
+  }
+  LogThisAt(5,"Input-state transition matrix has " << inOffset.back() << " nonzero entries" << endl);
+
+  vguard<double> x (n, 0), y (n, 0);
+  size_t nSources = 0;
+  for (State s = 0; s < n; ++s)
+    if (state[s].exitsWithInput (symbols)) {
+      x[s] = 1;
+      ++nSources;
     }
-    for (char c: alph)
-      eb[c].push_back (bases[c]);
-    current.swap (next);
-  };
+  Assert (nSources > 0, "Couldn't find any input states");
+  for (auto& p: x)
+    p /= (double) nSources;
 
   ProgressLog (plogSim, 1);
   plogSim.initProgress ("Estimating compression rate");
-  for (size_t step = 0; step < burnInSteps; ++step) {
-    plogSim.logProgress (step / (double) (burnInSteps + simSteps), "burn-in step %u/%u", step, simSteps + burnInSteps);
-    evolve();
-  }
-  eb.clear();
-  for (size_t step = 0; step < simSteps; ++step) {
-    plogSim.logProgress ((step + burnInSteps) / (double) (burnInSteps + simSteps), "step %u/%u", step + burnInSteps, simSteps + burnInSteps);
-    evolve();
+  size_t iter;
+  double delta = 1;
+  for (iter = 0; iter < maxIterations && delta > tolerance; ++iter) {
+    forEachRange ([&] (State first, State last) {
+	for (State d = first; d < last; ++d) {
+	  double p = 0;
+	  for (size_t k = inOffset[d]; k < inOffset[d+1]; ++k)
+	    p += inProb[k] * x[inSource[k]];
+	  y[d] = (x[d] + p) / 2;
+	}
+      });
+    const double total = accumulate (y.begin(), y.end(), 0.);
+    Assert (total > 0, "All probability was lost to end states");
+    delta = 0;
+    for (State s = 0; s < n; ++s) {
+      y[s] /= total;
+      delta += abs (y[s] - x[s]);
+    }
+    x.swap (y);
+    plogSim.logProgress (log (delta) / log (tolerance), "iteration %u, change %g", iter + 1, delta);
   }
-
-  logCurrent(3);
+  if (delta > tolerance)
+    Warn ("Stationary distribution did not converge after %u iterations (change %g)", iter, delta);
+  LogThisAt(3,"Stationary distribution converged to within " << delta << " after " << plural (iter, "iteration") << endl);
+  for (State s = 0; s < n; ++s)
+    if (x[s] > 0)
+      LogThisAt(5,"P(" << state[s].name << ") = " << x[s] << endl);
 
   map<char,double> bps;
   for (char c: alph)
-    bps[c] = accumulate (eb[c].begin(), eb[c].end(), 0.) / (double) eb[c].size();
+    bps[c] = 0;
+  for (State s = 0; s < n; ++s)
+    for (const auto& cb: edgeBases[s])
+      bps[cb.first] += x[s] * cb.second;
   return bps;
 }
 
@@ -502,103 +731,278 @@ bool Machine::isWaitingMachine() const {
   return true;
 }
 
+/* Index of fixed-width tuples of states, used to number product states during composition.
+   Tuples are stored end to end and looked up through an open-addressing hash table of tuple indices,
+   so memory scales with the number of tuples seen rather than with the size of the product.
+*/
+class StateTupleIndex {
+  const size_t width;
+  vguard<State> tupleState;  // tuple n is tupleState[n*width] to tupleState[(n+1)*width-1]
+  vguard<State> slot;  // 0 if empty, otherwise 1 + tuple index
+
+  size_t hash (const State* t) const {
+    unsigned long long h = 14695981039346656037ULL;  // FNV-1a over whole states
+    for (size_t k = 0; k < width; ++k)
+      h = (h ^ t[k]) * 1099511628211ULL;
+    return h ^ (h >> 32);
+  }
+
+  size_t findSlot (const State* t) const {
+    const size_t mask = slot.size() - 1;
+    size_t n = hash(t) & mask;
+    while (slot[n] && !equal (t, t + width, tuple (slot[n] - 1)))
+      n = (n + 1) & mask;
+    return n;
+  }
+
+public:
+  StateTupleIndex (size_t width) : width (width), slot (1024, 0) { }
+
+  inline State size() const { return tupleState.size() / width; }
+  inline const State* tuple (State n) const { return tupleState.data() + n * width; }
+
+  // returns the index of the tuple, adding it if it is new
+  State index (const State* t) {
+    size_t n = findSlot (t);
+    if (slot[n])
+      return slot[n] - 1;
+    const State idx = size();
+    tupleState.insert (tupleState.end(), t, t + width);
+    if (2 * size() > slot.size()) {
+      vguard<State> oldSlot (2 * slot.size(), 0);
+      swap (slot, oldSlot);
+      for (State m: oldSlot)
+	if (m)
+	  slot[findSlot (tuple (m - 1))] = m;
+      n = findSlot (t);
+    }
+    slot[n] = idx + 1;
+    return idx;
+  }
+
+  // returns the index of the tuple, or size() if it has not been seen
+  State find (const State* t) const {
+    const size_t n = findSlot (t);
+    return slot[n] ? slot[n] - 1 : size();
+  }
+};
+
+/* Builds the part of a product machine that is reachable from the start tuple, and from which the end tuple is reachable.
+   expand(tuple,trans,destTuples) appends each outgoing transition of a product state and the tuple it leads to.
+   describe(tuple,state) sets the name & contexts of a product state; it is only called for states that are kept.
+   States are numbered in lexicographic order of their tuples, and states whose only transition is null are merged with its destination.
+*/
+static Machine reachableProduct (const vguard<State>& start, const vguard<State>& end,
+				 function<void(const State*,vguard<MachineTransition>&,vguard<State>&)> expand,
+				 function<void(const State*,MachineState&)> describe,
+				 unsigned long long nProductStates) {
+  const size_t width = start.size();
+
+  // forward pass: expand reachable tuples, numbering them in order of discovery
+  StateTupleIndex tuples (width);
+  vguard<vguard<MachineTransition> > compTrans;
+  tuples.index (start.data());
+  vguard<State> destTuples;
+  for (State c = 0; c < tuples.size(); ++c) {
+    vguard<MachineTransition> trans;
+    destTuples.clear();
+    const vguard<State> tuple (tuples.tuple(c), tuples.tuple(c) + width);  // copied, as index() may reallocate
+    expand (tuple.data(), trans, destTuples);
+    for (size_t n = 0; n < trans.size(); ++n)
+      trans[n].dest = tuples.index (destTuples.data() + n * width);
+    compTrans.push_back (std::move (trans));
+  }
+  const State nReachable = tuples.size();
+
+  // backward pass over the reachable states, using a compressed table of sources
+  vguard<bool> endReachableFrom (nReachable, false);
+  const State endIdx = tuples.find (end.data());
+  if (endIdx < nReachable) {
+    vguard<State> sourceOffset (nReachable + 1, 0), source;
+    for (State s = 0; s < nReachable; ++s)
+      for (const auto& t: compTrans[s])
+	++sourceOffset[t.dest + 1];
+    for (State s = 0; s < nReachable; ++s)
+      sourceOffset[s+1] += sourceOffset[s];
+    source.resize (sourceOffset.back());
+    vguard<State> nextSource (sourceOffset);
+    for (State s = 0; s < nReachable; ++s)
+      for (const auto& t: compTrans[s])
+	source[nextSource[t.dest]++] = s;
+    deque<State> queue;
+    queue.push_back (endIdx);
+    endReachableFrom[endIdx] = true;
+    while (queue.size()) {
+      const State c = queue.front();
+      queue.pop_front();
+      for (State n = sourceOffset[c]; n < sourceOffset[c+1]; ++n)
+	if (!endReachableFrom[source[n]]) {
+	  endReachableFrom[source[n]] = true;
+	  queue.push_back (source[n]);
+	}
+    }
+  }
+
+  // keep states that are reachable and co-reachable, in tuple order, merging chains of null transitions
+  vguard<State> kept;
+  for (State s = 0; s < nReachable; ++s)
+    if (endReachableFrom[s])
+      kept.push_back (s);
+  sort (kept.begin(), kept.end(), [&] (State a, State b) {
+      return lexicographical_compare (tuples.tuple(a), tuples.tuple(a) + width, tuples.tuple(b), tuples.tuple(b) + width);
+    });
+  map<State,State> nullEquiv;
+  for (State s: kept) {
+    State d = s;
+    while (compTrans[d].size() == 1 && compTrans[d].front().isNull())
+      d = compTrans[d].front().dest;
+    if (d != s)
+      nullEquiv[s] = d;
+  }
+  vguard<State> old2new (nReachable);
+  State nStates = 0;
+  for (State oldIdx: kept)
+    if (!nullEquiv.count(oldIdx))
+      old2new[oldIdx] = nStates++;
+  for (State oldIdx: kept)
+    if (nullEquiv.count(oldIdx))
+      old2new[oldIdx] = old2new[nullEquiv.at(oldIdx)];
+  LogThisAt(3,"Transducer composition yielded " << nStates << "-state machine from " << nReachable << " reachable states, out of " << nProductStates << " in the full product" << endl);
+
+  Machine compMachine;
+  compMachine.state.reserve (nStates);
+  for (State oldIdx: kept)
+    if (!nullEquiv.count(oldIdx)) {
+      MachineState ms;
+      describe (tuples.tuple(oldIdx), ms);
+      for (const auto& t: compTrans[oldIdx])
+	ms.trans.push_back (MachineTransition (t.in, t.out, old2new[t.dest]));
+      compMachine.state.push_back (ms);
+    }
+  return compMachine;
+}
+
 Machine Machine::compose (const Machine& first, const Machine& origSecond) {
   LogThisAt(3,"Composing " << first.nStates() << "-state transducer with " << origSecond.nStates() << "-state transducer" << endl);
   const Machine second = origSecond.isWaitingMachine() ? origSecond : origSecond.waitingMachine();
   Assert (second.isWaitingMachine(), "Attempt to compose transducers A*B where B is not a waiting machine");
   Assert (first.state.back().isEnd(), "Last state must be end state");
   Assert (second.state.back().isEnd(), "Last state must be end state");
-  vguard<MachineState> comp (first.nStates() * second.nStates());
-  auto compState = [&](State i,State j) -> State {
-    return i * second.nStates() + j;
-  };
   auto compStateName = [&](State i,State j) -> string {
     return string("(") + first.state[i].name + "," + second.state[j].name + ")";
   };
-  for (State i = 0; i < first.nStates(); ++i)
-    for (State j = 0; j < second.nStates(); ++j) {
-      MachineState& ms = comp[compState(i,j)];
-      const MachineState& msi = first.state[i];
-      const MachineState& msj = second.state[j];
-      ms.name = compStateName(i,j);
-      ms.leftContext = msj.leftContext;
-      ms.rightContext = msj.rightContext;
-      if (msj.isWait() || msj.isEnd()) {
-	for (const auto& it: msi.trans)
-	  if (it.out == MachineNull) {
-	    ms.trans.push_back (MachineTransition (it.in, MachineNull, compState(it.dest,j)));
-	    LogThisAt(6,"Adding transition from " << ms.name << " to " << compStateName(it.dest,j) << endl);
-	  } else
-	    for (const auto& jt: msj.trans)
-	      if (it.out == jt.in) {
-		ms.trans.push_back (MachineTransition (it.in, jt.out, compState(it.dest,jt.dest)));
-		LogThisAt(6,"Adding transition from " << ms.name << " to " << compStateName(it.dest,jt.dest) << endl);
-	      }
+  auto expand = [&] (const State* ij, vguard<MachineTransition>& trans, vguard<State>& destPairs) {
+    const State i = ij[0], j = ij[1];
+    const MachineState& msi = first.state[i];
+    const MachineState& msj = second.state[j];
+    auto add = [&] (InputSymbol in, OutputSymbol out, State di, State dj) {
+      trans.push_back (MachineTransition (in, out, 0));
+      destPairs.push_back (di);
+      destPairs.push_back (dj);
+      LogThisAt(6,"Adding transition from " << compStateName(i,j) << " to " << compStateName(di,dj) << endl);
+    };
+    if (msj.isWait() || msj.isEnd()) {
+      for (const auto& it: msi.trans)
+	if (it.out == MachineNull)
+	  add (it.in, MachineNull, it.dest, j);
+	else
+	  for (const auto& jt: msj.trans)
+	    if (it.out == jt.in)
+	      add (it.in, jt.out, it.dest, jt.dest);
+    } else
+      for (const auto& jt: msj.trans)
+	add (MachineNull, jt.out, i, jt.dest);
+  };
+  auto describe = [&] (const State* ij, MachineState& ms) {
+    ms.name = compStateName (ij[0], ij[1]);
+    ms.leftContext = second.state[ij[1]].leftContext;
+    ms.rightContext = second.state[ij[1]].rightContext;
+  };
+  return reachableProduct (vguard<State> { first.startState(), second.startState() },
+			   vguard<State> { first.nStates() - 1, second.nStates() - 1 },
+			   expand, describe,
+			   first.nStates() * second.nStates());
+}
+
+/* The chain is composed right to left, as repeated pairwise composition would be, but in one pass over tuples of component states.
+   Machine k acts on the output of machine k-1. The composite of machines k..n can take input when:
+   - the composite of k+1..n is in a state with no outgoing transitions, or one that can take input, and
+   - machine k has a transition that either outputs nothing, or outputs a symbol the composite of k+1..n accepts.
+   Non-input transitions of the composite of k+1..n are always available.
+   This is equivalent to pairwise composition, where the inner machine is first converted to a waiting machine,
+   but there are no intermediate products, splits of mixed states, or null-merged states,
+   so the result is generally smaller than (though it encodes & decodes the same as) the pairwise composite.
+   A chain of two machines is delegated to pairwise composition, so single compositions are unchanged.
+*/
+Machine Machine::compose (const vguard<Machine>& chain) {
+  Assert (chain.size() > 0, "Empty composition chain");
+  if (chain.size() == 1)
+    return chain.front();
+  if (chain.size() == 2)
+    return compose (chain.front(), chain.back());
+  const size_t width = chain.size();
+  unsigned long long nProductStates = 1;
+  vguard<State> start, end;
+  for (const auto& m: chain) {
+    Assert (m.state.back().isEnd(), "Last state must be end state");
+    nProductStates *= m.nStates();
+    start.push_back (m.startState());
+    end.push_back (m.nStates() - 1);
+  }
+  LogThisAt(3,"Composing chain of " << width << " transducers with " << nProductStates << " possible product states" << endl);
+
+  // transitions of the composite of machines k..n, from the given tuple; destination tuples are written for machines k..n only
+  function<void(size_t,const State*,vguard<MachineTransition>&,vguard<State>&)> chainTrans;
+  chainTrans = [&] (size_t k, const State* tuple, vguard<MachineTransition>& trans, vguard<State>& dest) {
+    const size_t w = width - k;
+    const MachineState& ms = chain[k].state[tuple[k]];
+    if (k == width - 1) {
+      for (const auto& t: ms.trans) {
+	trans.push_back (MachineTransition (t.in, t.out, 0));
+	dest.push_back (t.dest);
+      }
+      return;
+    }
+    vguard<MachineTransition> innerTrans;
+    vguard<State> innerDest;
+    chainTrans (k + 1, tuple, innerTrans, innerDest);
+    bool innerTakesInput = innerTrans.empty();
+    for (size_t n = 0; n < innerTrans.size(); ++n) {
+      const MachineTransition& it = innerTrans[n];
+      if (it.inputEmpty()) {
+	trans.push_back (it);
+	dest.push_back (tuple[k]);
+	dest.insert (dest.end(), innerDest.begin() + n * (w - 1), innerDest.begin() + (n + 1) * (w - 1));
       } else
-	for (const auto& jt: msj.trans) {
-	  ms.trans.push_back (MachineTransition (MachineNull, jt.out, compState(i,jt.dest)));
-	  LogThisAt(6,"Adding transition from " << ms.name << " to " << compStateName(i,jt.dest) << endl);
-	}
+	innerTakesInput = true;
     }
-  vguard<bool> reachableFromStart (comp.size(), false);
-  deque<State> queue;
-  queue.push_back (compState(first.startState(),second.startState()));
-  reachableFromStart[queue.front()] = true;
-  while (queue.size()) {
-    const State c = queue.front();
-    queue.pop_front();
-    for (const auto& t: comp[c].trans)
-      if (!reachableFromStart[t.dest]) {
-	reachableFromStart[t.dest] = true;
-	queue.push_back (t.dest);
+    if (innerTakesInput)
+      for (const auto& t: ms.trans) {
+	if (t.outputEmpty()) {
+	  trans.push_back (MachineTransition (t.in, MachineNull, 0));
+	  dest.push_back (t.dest);
+	  dest.insert (dest.end(), tuple + k + 1, tuple + width);
+	} else
+	  for (size_t n = 0; n < innerTrans.size(); ++n)
+	    if (innerTrans[n].in == t.out) {
+	      trans.push_back (MachineTransition (t.in, innerTrans[n].out, 0));
+	      dest.push_back (t.dest);
+	      dest.insert (dest.end(), innerDest.begin() + n * (w - 1), innerDest.begin() + (n + 1) * (w - 1));
+	    }
       }
-  }
-
-  vguard<bool> endReachableFrom (comp.size(), false);
-  vguard<vguard<State> > sources (comp.size());
-  for (State s = 0; s < comp.size(); ++s)
-    for (const auto& t: comp[s].trans)
-      sources[t.dest].push_back (s);
-  queue.push_back (compState(first.nStates()-1,second.nStates()-1));
-  endReachableFrom[queue.front()] = true;
-  while (queue.size()) {
-    const State c = queue.front();
-    queue.pop_front();
-    for (State src: sources[c])
-      if (!endReachableFrom[src]) {
-	endReachableFrom[src] = true;
-	queue.push_back (src);
-      }
-  }
+  };
 
-  map<State,State> nullEquiv;
-  for (State s = 0; s < comp.size(); ++s)
-    if (reachableFromStart[s] && endReachableFrom[s]) {
-      State d = s;
-      while (comp[d].trans.size() == 1 && comp[d].trans.front().isNull())
-	d = comp[d].trans.front().dest;
-      if (d != s)
-	nullEquiv[s] = d;
-    }
-  vguard<State> old2new (comp.size());
-  State nStates = 0;
-  for (State oldIdx = 0; oldIdx < comp.size(); ++oldIdx)
-    if (reachableFromStart[oldIdx] && endReachableFrom[oldIdx] && !nullEquiv.count(oldIdx))
-      old2new[oldIdx] = nStates++;
-  for (State oldIdx = 0; oldIdx < comp.size(); ++oldIdx)
-    if (reachableFromStart[oldIdx] && endReachableFrom[oldIdx] && nullEquiv.count(oldIdx))
-      old2new[oldIdx] = old2new[nullEquiv.at(oldIdx)];
-  for (State oldIdx = 0; oldIdx < comp.size(); ++oldIdx)
-    if (reachableFromStart[oldIdx] && endReachableFrom[oldIdx])
-      for (auto& t: comp[oldIdx].trans)
-	t.dest = old2new[t.dest];
-  LogThisAt(3,"Transducer composition yielded " << nStates << "-state machine; " << plural (comp.size() - nStates, "more state was", "more states were") << " unreachable" << endl);
-  Machine compMachine;
-  compMachine.state.reserve (nStates);
-  for (State oldIdx = 0; oldIdx < comp.size(); ++oldIdx)
-    if (reachableFromStart[oldIdx] && endReachableFrom[oldIdx] && !nullEquiv.count(oldIdx))
-      compMachine.state.push_back (comp[oldIdx]);
-  return compMachine;
+  auto expand = [&] (const State* tuple, vguard<MachineTransition>& trans, vguard<State>& destTuples) {
+    chainTrans (0, tuple, trans, destTuples);
+  };
+  auto describe = [&] (const State* tuple, MachineState& ms) {
+    ms.name = chain.back().state[tuple[width-1]].name;
+    for (size_t k = width - 1; k > 0; --k)
+      ms.name = string("(") + chain[k-1].state[tuple[k-1]].name + "," + ms.name + ")";
+    ms.leftContext = chain.back().state[tuple[width-1]].leftContext;
+    ms.rightContext = chain.back().state[tuple[width-1]].rightContext;
+  };
+  return reachableProduct (start, end, expand, describe, nProductStates);
 }
 
 vguard<State> Machine::decoderToposort (const string& inputAlphabet) const {
@@ -668,3 +1072,104 @@ Machine Machine::waitingMachine() const {
   LogThisAt(5,"Converted " << nStates() << "-state transducer into " << wm.nStates() << "-state waiting machine" << endl);
   return wm;
 }
+
+/* Partition refinement: states start out grouped by context, and a group is split until all its members
+   have the same set of (input, output, destination group) transitions.
+   The result is the coarsest bisimulation that respects contexts; for a nondeterministic machine this can be larger than
+   the language-minimal machine, but it never changes which paths (and so which encodings) the machine allows.
+   Merged states keep the name and transition order of their lowest-numbered member.
+*/
+Machine Machine::minimize() const {
+  const State n = nStates();
+  Assert (n > 0 && state.back().isEnd(), "Last state must be end state");
+  vguard<State> block (n);
+  State nBlocks = 0;
+  {
+    map<pair<string,string>,State> contextBlock;
+    for (State s = 0; s < n; ++s) {
+      const auto key = make_pair (state[s].leftContext, state[s].rightContext);
+      auto iter = contextBlock.find (key);
+      if (iter == contextBlock.end())
+	iter = contextBlock.insert (make_pair (key, nBlocks++)).first;
+      block[s] = iter->second;
+    }
+  }
+
+  // transitions are packed into 64-bit signature entries, so each state's signature is a sorted run in one flat array
+  Assert (n < (1ULL << 48), "Too many states to minimize");
+  auto transCode = [&] (const MachineTransition& t) -> unsigned long long {
+    return (((unsigned long long) (unsigned char) t.in) << 56) | (((unsigned long long) (unsigned char) t.out) << 48) | block[t.dest];
+  };
+  vguard<size_t> sigOffset (n + 1, 0);
+  for (State s = 0; s < n; ++s)
+    sigOffset[s+1] = sigOffset[s] + state[s].trans.size();
+  vguard<unsigned long long> sig (sigOffset.back());
+  vguard<size_t> sigEnd (n);
+  vguard<State> order (n);
+  int rounds = 0;
+  while (true) {
+    ++rounds;
+    for (State s = 0; s < n; ++s) {
+      auto first = sig.begin() + sigOffset[s];
+      auto last = first;
+      for (const auto& t: state[s].trans)
+	*last++ = transCode (t);
+      sort (first, last);
+      sigEnd[s] = unique (first, last) - sig.begin();
+    }
+    for (State s = 0; s < n; ++s)
+      order[s] = s;
+    auto sigLess = [&] (State a, State b) {
+      if (block[a] != block[b])
+	return block[a] < block[b];
+      return lexicographical_compare (sig.begin() + sigOffset[a], sig.begin() + sigEnd[a], sig.begin() + sigOffset[b], sig.begin() + sigEnd[b]);
+    };
+    auto sigEqual = [&] (State a, State b) {
+      return block[a] == block[b] && sigEnd[a] - sigOffset[a] == sigEnd[b] - sigOffset[b]
+	&& equal (sig.begin() + sigOffset[a], sig.begin() + sigEnd[a], sig.begin() + sigOffset[b]);
+    };
+    sort (order.begin(), order.end(), sigLess);
+    vguard<State> newBlock (n);
+    State nNewBlocks = 0;
+    for (State k = 0; k < n; ++k)
+      newBlock[order[k]] = (k > 0 && sigEqual (order[k-1], order[k])) ? nNewBlocks - 1 : nNewBlocks++;
+    swap (block, newBlock);
+    if (nNewBlocks == nBlocks)
+      break;
+    nBlocks = nNewBlocks;
+  }
+
+  // number blocks by their lowest-numbered member, keeping the start state first and the end state last
+  const State endBlock = block[n-1];
+  vguard<State> blockRep (nBlocks, n), old2new (nBlocks);
+  for (State s = 0; s < n; ++s)
+    if (blockRep[block[s]] == n)
+      blockRep[block[s]] = s;
+  State nNew = 0;
+  for (State s = 0; s < n; ++s)
+    if (blockRep[block[s]] == s && block[s] != endBlock)
+      old2new[block[s]] = nNew++;
+  old2new[endBlock] = nNew++;
+
+  Machine minMachine;
+  minMachine.state.resize (nNew);
+  size_t oldTrans = 0, newTrans = 0;
+  for (State s = 0; s < n; ++s) {
+    oldTrans += state[s].trans.size();
+    if (blockRep[block[s]] == s) {
+      MachineState& ms = minMachine.state[old2new[block[s]]];
+      ms.name = state[s].name;
+      ms.leftContext = state[s].leftContext;
+      ms.rightContext = state[s].rightContext;
+      for (const auto& t: state[s].trans) {
+	const MachineTransition mt (t.in, t.out, old2new[block[t.dest]]);
+	if (find_if (ms.trans.begin(), ms.trans.end(), [&] (const MachineTransition& u) { return u.in == mt.in && u.out == mt.out && u.dest == mt.dest; }) == ms.trans.end())
+	  ms.trans.push_back (mt);
+      }
+      newTrans += ms.trans.size();
+    }
+  }
+  LogThisAt(2,"Minimization merged " << n << " states into " << nNew << " (" << setprecision(3) << 100. * (double) (n - nNew) / (double) n << "% fewer) and "
+	    << oldTrans << " transitions into " << newTrans << " (" << 100. * (double) (oldTrans - newTrans) / (double) max (oldTrans, (size_t) 1) << "% fewer), after " << plural (rounds, "refinement round") << endl);
+  return minMachine;
+}
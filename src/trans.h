@@ -3,6 +3,7 @@
 
 #include <string>
 #include <map>
+#include <cstdint>
 #include "vguard.h"
 
 using namespace std;
@@ -90,6 +91,7 @@ struct Machine {
   bool isWaitingMachine() const;
 
   static Machine compose (const Machine& first, const Machine& second);
+  static Machine compose (const vguard<Machine>& chain);  // chain.front() is applied first, i.e. outermost
   
   void write (ostream& out) const;
   void writeDot (ostream& out) const;
@@ -119,10 +121,133 @@ struct Machine {
   string outputAlphabet() const;
   string inputDescriptionTable() const;
 
-  map<InputSymbol,double> expectedBasesPerInputSymbol (const char* symbols = "01") const;
+  map<InputSymbol,double> expectedBasesPerInputSymbol (const char* symbols = "01", int nThreads = 1) const;
 
   Machine waitingMachine() const;  // convert to waiting machine
+  Machine minimize() const;  // merge bisimilar states with the same contexts
   vguard<State> decoderToposort (const string& inputAlphabet) const;  // topological sort by non-output transitions
 };
 
+/* Read-only view of a contiguous array, e.g. one state's transitions in a FrozenMachine */
+template<typename T>
+struct ConstRange {
+  const T* first;
+  const T* last;
+  ConstRange() : first (NULL), last (NULL) { }
+  ConstRange (const T* first, const T* last) : first (first), last (last) { }
+  inline const T* begin() const { return first; }
+  inline const T* end() const { return last; }
+  inline size_t size() const { return last - first; }
+  inline bool empty() const { return first == last; }
+  inline const T& operator[] (size_t n) const { return first[n]; }
+  inline const T& front() const { return *first; }
+  inline const T& back() const { return *(last - 1); }
+};
+
+/* String held in a PackedStrings buffer. The buffer is NUL-terminated after each string, so c_str() needs no copy */
+struct PackedString : ConstRange<char> {
+  PackedString (const char* first, const char* last) : ConstRange<char> (first, last) { }
+  inline const char* c_str() const { return first; }
+  inline operator string() const { return string (first, last); }
+};
+
+inline ostream& operator<< (ostream& out, const PackedString& s) {
+  return out.write (s.begin(), s.size());
+}
+
+/* Strings packed end to end, each followed by a NUL; string n occupies chars[offset[n]] to chars[offset[n+1]-2] */
+struct PackedStrings {
+  const char* chars;
+  const uint64_t* offset;
+  PackedStrings() : chars (NULL), offset (NULL) { }
+  inline PackedString operator[] (size_t n) const {
+    return PackedString (chars + offset[n], chars + offset[n+1] - 1);
+  }
+};
+
+/* One state of a FrozenMachine, with the parts of the MachineState interface used by Encoder and Decoder */
+struct FrozenMachineState {
+  PackedString name, leftContext, rightContext;
+  ConstRange<MachineTransition> trans;
+  FrozenMachineState (const PackedString& name, const PackedString& leftContext, const PackedString& rightContext, const ConstRange<MachineTransition>& trans)
+    : name (name), leftContext (leftContext), rightContext (rightContext), trans (trans)
+  { }
+  inline const MachineTransition* transFor (InputSymbol in) const {
+    for (const auto& t: trans)
+      if (t.in == in)
+	return &t;
+    return NULL;
+  }
+  inline bool isEnd() const { return trans.empty(); }
+  inline bool exitsWithInput() const {
+    for (const auto& t: trans)
+      if (t.in)
+	return true;
+    return false;
+  }
+  inline bool emitsOutput() const {
+    for (const auto& t: trans)
+      if (t.out)
+	return true;
+    return false;
+  }
+};
+
+/* Immutable copy of a Machine in compressed sparse row layout:
+   all transitions are in one array, ordered by source state, with each state's transitions delimited by transOffset.
+   Names & contexts are packed into shared character buffers.
+   Traversals touch contiguous memory instead of one heap block per state.
+
+   The arrays are laid out in one block, which is also the binary machine file format (--save-machine-bin).
+   A binary file is memory-mapped read-only and used in place (--load-machine-bin), so loading does no parsing,
+   and concurrent processes share its pages.
+   The format is only portable between hosts with the same byte order and MachineTransition layout; the header records both.
+*/
+struct FrozenMachine {
+  struct Header {
+    char magic[8];
+    uint32_t version, byteOrder, transitionBytes, reserved;
+    uint64_t nStates, nTransitions, nameChars, leftContextChars, rightContextChars;
+    size_t totalBytes() const;
+  };
+  static const uint32_t binaryVersion = 1;
+
+  const MachineTransition* transition;
+  const uint64_t* transOffset;
+  PackedStrings name, leftContext, rightContext;
+
+  struct StateTable {
+    const FrozenMachine& machine;
+    StateTable (const FrozenMachine& machine) : machine (machine) { }
+    inline FrozenMachineState operator[] (State s) const {
+      return FrozenMachineState (machine.name[s], machine.leftContext[s], machine.rightContext[s],
+				 ConstRange<MachineTransition> (machine.transition + machine.transOffset[s],
+								machine.transition + machine.transOffset[s+1]));
+    }
+    inline State size() const { return machine.header->nStates; }
+  };
+  StateTable state;
+
+  FrozenMachine (const Machine& machine);
+  explicit FrozenMachine (const char* binaryFilename);  // maps the file
+  FrozenMachine (const FrozenMachine&) = delete;
+  FrozenMachine& operator= (const FrozenMachine&) = delete;
+  ~FrozenMachine();
+
+  inline State nStates() const { return state.size(); }
+  State startState() const;
+
+  void writeBinary (ostream& out) const;
+  void saveBinary (const string& filename) const;  // fails if the file can't be written in full
+  Machine thaw() const;  // convert back to a mutable Machine
+
+private:
+  const Header* header;
+  vguard<uint64_t> ownedData;  // used when frozen from a Machine
+  void* mappedData;  // used when loaded from a file
+  size_t mappedBytes;
+
+  void attach (const char* data, size_t bytes, const char* source);
+};
+
 #endif /* TRANSDUCER_INCLUDED */
@@ -1,5 +1,6 @@
 #include <list>
 #include <iomanip>
+#include <numeric>
 #include "viterbi.h"
 #include "logger.h"
 
@@ -27,15 +28,47 @@ MachineScores::MachineScores (const Machine& machine, const InputModel& inputMod
   for (char c: machine.outputAlphabet())
     Assert (isValidToken(c,dnaAlphabetString), "Not a DNA-outputting machine");
 
-  for (State s = 0; s < machine.nStates(); ++s) {
+  auto isScored = [&] (const MachineTransition& t) {
+    return t.inputEmpty() || t.isEOF() || inputModel.symProb.count(t.in);
+  };
+
+  // first pass: count list entries for each state, then convert counts to offsets
+  const State nStates = machine.nStates();
+  vguard<size_t> leftOffset (nStates + 1, 0), inEmitOffset (nStates + 1, 0), inNullOffset (nStates + 1, 0), outEmitOffset (nStates + 1, 0), outNullOffset (nStates + 1, 0);
+  for (State s = 0; s < nStates; ++s) {
     const MachineState& ms = machine.state[s];
-    StateScores& ss = stateScores[s];
-    ss.leftContext.reserve (ms.leftContext.size());
     for (char lc: ms.leftContext)
       if (lc != MachineWildContext)
-	ss.leftContext.push_back (charToBase (lc));
-    for (const auto& t: ms.trans) {
-      if (t.inputEmpty() || t.isEOF() || inputModel.symProb.count(t.in)) {
+	++leftOffset[s+1];
+    for (const auto& t: ms.trans)
+      if (isScored(t)) {
+	if (t.outputEmpty()) {
+	  ++inNullOffset[t.dest+1];
+	  ++outNullOffset[s+1];
+	} else {
+	  ++inEmitOffset[t.dest+1];
+	  ++outEmitOffset[s+1];
+	}
+      }
+  }
+  for (auto offset: { &leftOffset, &inEmitOffset, &inNullOffset, &outEmitOffset, &outNullOffset })
+    partial_sum (offset->begin(), offset->end(), offset->begin());
+
+  // second pass: fill the lists, in the same order as transitions appear in the machine
+  leftContextBase.resize (leftOffset.back());
+  incomingEmit.resize (inEmitOffset.back());
+  incomingNull.resize (inNullOffset.back());
+  outgoingEmit.resize (outEmitOffset.back());
+  outgoingNull.resize (outNullOffset.back());
+  vguard<size_t> inEmitNext (inEmitOffset), inNullNext (inNullOffset);
+  for (State s = 0; s < nStates; ++s) {
+    const MachineState& ms = machine.state[s];
+    size_t leftNext = leftOffset[s], outEmitNext = outEmitOffset[s], outNullNext = outNullOffset[s];
+    for (char lc: ms.leftContext)
+      if (lc != MachineWildContext)
+	leftContextBase[leftNext++] = charToBase (lc);
+    for (const auto& t: ms.trans)
+      if (isScored(t)) {
 	IncomingTransScore its;
 	its.src = s;
 	its.score = inputModel.symProb.count(t.in) ? log(inputModel.symProb.at(t.in)) : 0;
@@ -45,17 +78,24 @@ MachineScores::MachineScores (const Machine& machine, const InputModel& inputMod
 	ots.dest = t.dest;
 	ots.score = its.score;
 	
-	StateScores& destStateScores = stateScores[t.dest];
 	if (t.outputEmpty()) {
-	  destStateScores.incomingNull.push_back (its);
-	  ss.outgoingNull.push_back (ots);
+	  incomingNull[inNullNext[t.dest]++] = its;
+	  outgoingNull[outNullNext++] = ots;
 	} else {
 	  its.base = charToBase (t.out);
-	  destStateScores.incomingEmit.push_back (its);
-	  ss.outgoingEmit.push_back (ots);
+	  incomingEmit[inEmitNext[t.dest]++] = its;
+	  outgoingEmit[outEmitNext++] = ots;
 	}
       }
-    }
+  }
+
+  for (State s = 0; s < nStates; ++s) {
+    StateScores& ss = stateScores[s];
+    ss.leftContext = ConstRange<Base> (leftContextBase.data() + leftOffset[s], leftContextBase.data() + leftOffset[s+1]);
+    ss.incomingEmit = ConstRange<IncomingTransScore> (incomingEmit.data() + inEmitOffset[s], incomingEmit.data() + inEmitOffset[s+1]);
+    ss.incomingNull = ConstRange<IncomingTransScore> (incomingNull.data() + inNullOffset[s], incomingNull.data() + inNullOffset[s+1]);
+    ss.outgoingEmit = ConstRange<OutgoingTransScore> (outgoingEmit.data() + outEmitOffset[s], outgoingEmit.data() + outEmitOffset[s+1]);
+    ss.outgoingNull = ConstRange<OutgoingTransScore> (outgoingNull.data() + outNullOffset[s], outgoingNull.data() + outNullOffset[s+1]);
   }
 }
 
@@ -303,18 +343,20 @@ string ViterbiMatrix::traceback() const {
   return string (trace.begin(), trace.end());
 }
 
-vguard<FastSeq> decodeFastSeqs (const char* filename, const Machine& machine, const MutatorParams& mutatorParams) {
-  const vguard<FastSeq> outseqs = readFastSeqs (filename);
-  vguard<FastSeq> inseqs;
+void decodeFastSeqs (const char* filename, const Machine& machine, const MutatorParams& mutatorParams, size_t batchSize, const function<void (const vguard<FastSeq>&)>& writeBatch) {
+  Require (batchSize > 0, "Batch size must be positive");
   const string inAlph = machine.inputAlphabet (MachineRelaxedInputFlag | MachineControlInputFlag | MachineSEOFInputFlag);
   const InputModel inmod (inAlph, 1., pow(4.,-(double)(4*mutatorParams.maxDupLen())));  // somewhat arbitrary penalty for control characters. Rationale: maxDupLen is typically half of codeword length; paths to control chars are typically <1.5*codeword length
   LogThisAt(6,"Input model for Viterbi decoding:" << endl << inmod.toString());
-  for (auto& outseq: outseqs) {
-    ViterbiMatrix vit (machine, inmod, mutatorParams, outseq);
-    FastSeq inseq;
-    inseq.name = outseq.name;
-    inseq.seq = vit.traceback();
-    inseqs.push_back (inseq);
+  FastSeqReader reader (filename);
+  vguard<FastSeq> outseqs, inseqs;
+  while (reader.readBatch (outseqs, batchSize)) {
+    inseqs.resize (outseqs.size());
+    for (size_t n = 0; n < outseqs.size(); ++n) {
+      ViterbiMatrix vit (machine, inmod, mutatorParams, outseqs[n]);
+      inseqs[n].name = outseqs[n].name;
+      inseqs[n].seq = vit.traceback();
+    }
+    writeBatch (inseqs);
   }
-  return inseqs;
 }
@@ -1,6 +1,7 @@
 #ifndef VITERBI_INCLUDED
 #define VITERBI_INCLUDED
 
+#include <functional>
 #include "mutator.h"
 #include "fastseq.h"
 
@@ -28,15 +29,20 @@ struct OutgoingTransScore {
 };
 
 struct StateScores {
-  vguard<Base> leftContext;
-  vguard<IncomingTransScore> incomingEmit, incomingNull;
-  vguard<OutgoingTransScore> outgoingEmit, outgoingNull;
+  ConstRange<Base> leftContext;
+  ConstRange<IncomingTransScore> incomingEmit, incomingNull;
+  ConstRange<OutgoingTransScore> outgoingEmit, outgoingNull;
   inline Base base() const { return leftContext.back(); }
 };
 
+// each kind of per-state list is stored contiguously for all states, ordered by state; StateScores points into these arrays
 struct MachineScores {
+  vguard<Base> leftContextBase;
+  vguard<IncomingTransScore> incomingEmit, incomingNull;
+  vguard<OutgoingTransScore> outgoingEmit, outgoingNull;
   vguard<StateScores> stateScores;
   MachineScores (const Machine& machine, const InputModel& inputModel);
+  MachineScores (const MachineScores&) = delete;
 };
 
 class ViterbiMatrix {
@@ -105,6 +111,7 @@ public:
   inline Base tanDupBase (const StateScores& ss, Pos dupIdx) const { return ss.leftContext[ss.leftContext.size() - 1 - dupIdx]; }
 };
 
-vguard<FastSeq> decodeFastSeqs (const char* filename, const Machine& machine, const MutatorParams& mutatorParams);
+// reads a FASTA/FASTQ file batchSize records at a time, passing each batch of decoded records to writeBatch, so memory use doesn't grow with the file
+void decodeFastSeqs (const char* filename, const Machine& machine, const MutatorParams& mutatorParams, size_t batchSize, const function<void (const vguard<FastSeq>&)>& writeBatch);
 
 #endif /* VITERBI_INCLUDED */
@@ -0,0 +1,78 @@
+#include <chrono>
+#include <random>
+#include <sstream>
+#include "../src/encoder.h"
+#include "../src/decoder.h"
+#include "../src/decodertable.h"
+
+/* Times Encoder, Decoder and the determinized decoder on pseudorandom bytes, to track the per-symbol cost of the engines */
+
+struct StringWriter {
+  string out;
+  void write (const char* buf, size_t n) { out.append (buf, n); }
+};
+
+double secondsSince (const chrono::steady_clock::time_point& start) {
+  return chrono::duration<double> (chrono::steady_clock::now() - start).count();
+}
+
+int main (int argc, char** argv) {
+  if (argc != 2 && argc != 3) {
+    cout << "Usage: " << argv[0] << " <machine.json> [<bytes>]" << endl;
+    exit (EXIT_FAILURE);
+  }
+
+  const Machine machine = Machine::fromFile (argv[1]);
+  const FrozenMachine frozen (machine);
+  const size_t nBytes = argc == 3 ? atol (argv[2]) : 100000;
+
+  mt19937 rnd (0);
+  string data (nBytes, 0);
+  for (auto& c: data)
+    c = (char) (rnd() & 0xff);
+
+  StringWriter dna;
+  auto start = chrono::steady_clock::now();
+  {
+    Encoder<StringWriter,FrozenMachine> encoder (frozen, dna);
+    encoder.encodeString (data);
+  }
+  const double encodeTime = secondsSince (start);
+
+  ostringstream decoded;
+  start = chrono::steady_clock::now();
+  {
+    BinaryWriter writer (decoded);
+    Decoder<BinaryWriter,FrozenMachine> decoder (frozen, writer);
+    decoder.decodeString (dna.out);
+  }
+  const double decodeTime = secondsSince (start);
+
+  DecoderTable<FrozenMachine> table (frozen);
+  start = chrono::steady_clock::now();
+  table.determinize();
+  const double determinizeTime = secondsSince (start);
+
+  ostringstream tableDecoded;
+  start = chrono::steady_clock::now();
+  {
+    BinaryWriter writer (tableDecoded);
+    CompiledDecoder<BinaryWriter,FrozenMachine> decoder (frozen, writer, table);
+    decoder.decodeString (dna.out);
+  }
+  const double tableDecodeTime = secondsSince (start);
+
+  cout << "Encoded " << nBytes << " bytes as " << dna.out.size() << " bases in " << encodeTime << " s ("
+       << nBytes / encodeTime / 1e6 << " MB/s)" << endl;
+  cout << "Decoded " << dna.out.size() << " bases in " << decodeTime << " s ("
+       << nBytes / decodeTime / 1e6 << " MB/s)" << endl;
+  cout << "Determinized decoder (" << table.nConfigs() << " configurations) in " << determinizeTime << " s; decoded in "
+       << tableDecodeTime << " s (" << nBytes / tableDecodeTime / 1e6 << " MB/s)" << endl;
+
+  if (decoded.str() != data || tableDecoded.str() != data) {
+    cout << "Decoded data differs from input" << endl;
+    exit (EXIT_FAILURE);
+  }
+
+  return EXIT_SUCCESS;
+}
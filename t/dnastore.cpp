@@ -11,7 +11,10 @@
 #include "../src/pattern.h"
 #include "../src/builder.h"
 #include "../src/encoder.h"
+#include "../src/compiledencoder.h"
+#include "../src/chunkedencoder.h"
 #include "../src/decoder.h"
+#include "../src/decodertable.h"
 #include "../src/fastseq.h"
 #include "../src/mutator.h"
 #include "../src/fwdback.h"
@@ -21,7 +24,7 @@ using namespace std;
 
 namespace po = boost::program_options;
 
-void getMotifs (po::variables_map& vm, const char* arg, set<KmerLen>& motifs, set<KmerLen>& motifRevComps) {
+void getMotifs (po::variables_map& vm, const char* arg, MotifSet& motifs, MotifSet& motifRevComps) {
   if (vm.count(arg))
     for (const auto& x: vm.at(arg).as<vector<string> >()) {
       const Kmer motif = stringToKmer (x);
@@ -31,6 +34,135 @@ void getMotifs (po::variables_map& vm, const char* arg, set<KmerLen>& motifs, se
     }
 }
 
+// true if the machine, or anything else, will be written to stdout
+bool writesToStdout (const po::variables_map& vm) {
+  if (vm.count("save-machine") && vm.at("save-machine").as<string>() == "-")
+    return true;
+  for (const char* opt: { "encode-file", "decode-file", "encode-string", "decode-string", "encode-bits", "decode-bits",
+	"decode-viterbi", "rate", "dot", "token-info", "print-controls" })
+    if (vm.count(opt))
+      return true;
+  return !vm.count("save-machine") && !vm.count("save-machine-bin");
+}
+
+void writeBuildProfile (const po::variables_map& vm, const TransBuilder& builder) {
+  if (vm.count("profile-build")) {
+    const string filename = vm.at("profile-build").as<string>();
+    if (filename == "-")
+      builder.writeBuildProfileJSON (cout);
+    else {
+      ofstream out (filename);
+      if (!out)
+	Fail ("Couldn't open %s to write build profile", filename.c_str());
+      builder.writeBuildProfileJSON (out);
+      out.close();
+      if (!out)
+	Fail ("Couldn't write build profile to %s", filename.c_str());
+    }
+  }
+}
+
+bool encodesOrDecodes (const po::variables_map& vm) {
+  for (const char* opt: { "encode-file", "decode-file", "encode-string", "decode-string", "encode-bits", "decode-bits" })
+    if (vm.count(opt))
+      return true;
+  return false;
+}
+
+// returns NULL unless a determinized decoder was requested
+template<class MachineType>
+DecoderTable<MachineType>* makeDecoderTable (const po::variables_map& vm, const MachineType& machine) {
+  if (!vm.count("compile-decoder") && !vm.count("decoder-table"))
+    return NULL;
+  DecoderTable<MachineType>* table = new DecoderTable<MachineType> (machine);
+  if (vm.count("decoder-table"))
+    table->loadOrSave (vm.at("decoder-table").as<string>());
+  else
+    table->determinize();
+  return table;
+}
+
+// returns false if no encoding or decoding was requested
+template<class MachineType>
+bool encodeOrDecode (const po::variables_map& vm, const MachineType& machine, bool rawSeqOutput) {
+  if (vm.count("encode-file")) {
+    const string filename = vm.at("encode-file").as<string>();
+    ifstream infile (filename, std::ios::binary);
+    if (!infile)
+      throw runtime_error ("Binary file not found");
+    if (vm.count("chunk-size")) {
+      encodeChunks (machine, infile, cout, vm.at("chunk-size").as<size_t>(), vm.at("threads").as<int>(), filename, rawSeqOutput, vm.count("compile-encoder"));
+      return true;
+    }
+    FastaWriter writer (cout, rawSeqOutput ? NULL : filename.c_str());
+    if (vm.count("compile-encoder")) {
+      CompiledEncoder<FastaWriter,MachineType> encoder (machine, writer);
+      encoder.encodeStream (infile);
+    } else {
+      Encoder<FastaWriter,MachineType> encoder (machine, writer);
+      encoder.encodeStream (infile);
+    }
+	
+  } else if (vm.count("decode-file")) {
+    unique_ptr<DecoderTable<MachineType> > table (makeDecoderTable (vm, machine));
+    const size_t batchSize = vm.at("batch-size").as<size_t>();
+    Require (batchSize > 0, "Batch size must be positive");
+    FastSeqReader reader (vm.at("decode-file").as<string>().c_str());
+    vguard<FastSeq> batch;
+    while (reader.readBatch (batch, batchSize)) {
+      for (auto& fs: batch) {
+	// each record is a complete encoding, e.g. one block from --chunk-size, so padding bits at its end are discarded
+	BinaryWriter writer (cout);
+	if (table) {
+	  CompiledDecoder<BinaryWriter,MachineType> decoder (machine, writer, *table);
+	  decoder.decodeString (fs.seq);
+	} else {
+	  Decoder<BinaryWriter,MachineType> decoder (machine, writer);
+	  decoder.decodeString (fs.seq);
+	}
+      }
+      cout.flush();
+    }
+
+  } else if (vm.count("encode-string")) {
+    FastaWriter writer (cout, rawSeqOutput ? NULL : "ASCII_string");
+    if (vm.count("compile-encoder")) {
+      CompiledEncoder<FastaWriter,MachineType> encoder (machine, writer);
+      encoder.encodeString (vm.at("encode-string").as<string>());
+    } else {
+      Encoder<FastaWriter,MachineType> encoder (machine, writer);
+      encoder.encodeString (vm.at("encode-string").as<string>());
+    }
+      
+  } else if (vm.count("decode-string")) {
+    BinaryWriter writer (cout);
+    unique_ptr<DecoderTable<MachineType> > table (makeDecoderTable (vm, machine));
+    if (table) {
+      CompiledDecoder<BinaryWriter,MachineType> decoder (machine, writer, *table);
+      decoder.decodeString (vm.at("decode-string").as<string>());
+    } else {
+      Decoder<BinaryWriter,MachineType> decoder (machine, writer);
+      decoder.decodeString (vm.at("decode-string").as<string>());
+    }
+
+  } else if (vm.count("encode-bits")) {
+    FastaWriter writer (cout, rawSeqOutput ? NULL : "bit_string");
+    Encoder<FastaWriter,MachineType> encoder (machine, writer);
+    encoder.encodeSymbolString (vm.at("encode-bits").as<string>());
+      
+  } else if (vm.count("decode-bits")) {
+    Decoder<ostream,MachineType> decoder (machine, cout);
+    decoder.decodeString (vm.at("decode-bits").as<string>());
+    decoder.close();
+
+    cout << endl;
+
+  } else
+    return false;
+
+  return true;
+}
+
 int main (int argc, char** argv) {
 
 #ifndef DEBUG
@@ -52,19 +184,32 @@ int main (int argc, char** argv) {
       ("no-start", "do not use a control word at start of encoded sequence")
       ("no-end", "do not use a control word at end of encoded sequence")
       ("delay,y", "build delayed machine")
+      ("threads", po::value<int>()->default_value(1), "number of threads to use when building machine, estimating rate, or encoding blocks")
+      ("mmap-dir", po::value<string>(), "keep per-k-mer tables in memory-mapped temporary files in this directory, to build machines too large for RAM")
+      ("implicit", "when encoding or decoding with a newly built machine, synthesize its states on demand instead of storing them")
+      ("profile-build", po::value<string>(), "write JSON report of time, memory & item counts for each machine-building phase to file (- for stdout)")
+      ("cache-dir", po::value<string>(), "directory of cached machines, keyed by builder parameters (rebuilt if --print-controls is specified)")
       ("rate,R", "calculate compression rate")
       ("dot", "print in Graphviz format")
       ("token-info", "print descriptions of input tokens")
       ("load-machine,L", po::value<string>(), "load machine from JSON file")
       ("save-machine,S", po::value<string>(), "save machine to JSON file")
+      ("load-machine-bin", po::value<string>(), "load machine from binary file, mapping it into memory instead of parsing it")
+      ("save-machine-bin", po::value<string>(), "save machine to binary file")
       ("compose-machine,C", po::value<vector<string> >(), "load machine from JSON file and compose in front of primary machine")
+      ("minimize", "merge equivalent states of machine (after any composition) and report the reduction")
       ("encode-file,e", po::value<string>(), "encode binary file to FASTA on stdout")
       ("decode-file,d", po::value<string>(), "decode FASTA file to binary on stdout")
       ("encode-string,E", po::value<string>(), "encode ASCII string to FASTA on stdout")
+      ("chunk-size", po::value<size_t>(), "when encoding a file, split it into blocks of this many bytes, each encoded as a separate FASTA record (uses --threads)")
+      ("compile-encoder", "when encoding a file or string, cache the output & next encoder configuration for each byte, so repeated steps are table lookups")
       ("decode-string,D", po::value<string>(), "decode DNA sequence to binary on stdout")
+      ("compile-decoder", "when decoding a file or string, determinize the decoder first, so each base is a table lookup")
+      ("decoder-table", po::value<string>(), "load determinized decoder from this file, or build & save it there if missing or out of date (implies --compile-decoder)")
       ("encode-bits,b", po::value<string>(), "encode string of bits and control symbols to FASTA on stdout")
       ("decode-bits,B", po::value<string>(), "decode DNA sequence to string of bits and control symbols on stdout")
       ("decode-viterbi,V", po::value<string>(), "decode FASTA file using Viterbi algorithm")
+      ("batch-size", po::value<size_t>()->default_value(1000), "number of FASTA/FASTQ records to hold in memory when decoding a file; results are written after each batch")
       ("raw,r", "strip headers from FASTA output; just print raw sequence")
       ("error-sub-prob", po::value<double>()->default_value(.01), "substitution probability for error model")
       ("error-iv-ratio", po::value<double>()->default_value(10), "transition/transversion ratio for error model")
@@ -92,6 +237,8 @@ int main (int argc, char** argv) {
     }
 
     logger.parseLogArgs (vm);
+    Require (!(vm.count("profile-build") && vm.at("profile-build").as<string>() == "-" && writesToStdout (vm)),
+	     "--profile-build - can only be used when nothing else is written to stdout; give it a filename instead");
     
     const Pos len = vm.at("length").as<int>();
     Assert (len <= 31, "Maximum context is 31 bases");
@@ -111,6 +258,9 @@ int main (int argc, char** argv) {
     builder.controlWordAtStart = !vm.count("no-start");
     builder.controlWordAtEnd = !vm.count("no-end");
     builder.buildDelayedMachine = vm.count("delay");
+    builder.nThreads = vm.at("threads").as<int>();
+    if (vm.count("mmap-dir"))
+      builder.mappedDir = vm.at("mmap-dir").as<string>();
 
     MutatorParams mut;
     if (vm.count("error-file")) {
@@ -145,25 +295,53 @@ int main (int argc, char** argv) {
       const MutatorCounts counts = expectedCounts (mut, db, ll, strictAlignments);
       counts.writeJSON (cout);
 
+    } else if (vm.count("implicit")) {
+      Require (!vm.count("load-machine") && !vm.count("compose-machine") && !vm.count("save-machine") && !vm.count("cache-dir"),
+	       "--implicit can't be used with options that load, save or compose machines");
+      const ImplicitMachine machine = builder.makeImplicitMachine();
+      if (vm.count("print-controls"))
+	cout << "Control words: " << join(builder.controlWordString) << endl;
+      writeBuildProfile (vm, builder);
+      Require (encodeOrDecode (vm, machine, rawSeqOutput), "--implicit needs one of the encode or decode options");
+
+    } else if (vm.count("load-machine-bin") && encodesOrDecodes (vm)
+	       && !vm.count("load-machine") && !vm.count("compose-machine") && !vm.count("save-machine") && !vm.count("save-machine-bin")) {
+      // use the mapped machine in place
+      const FrozenMachine machine (vm.at("load-machine-bin").as<string>().c_str());
+      encodeOrDecode (vm, machine, rawSeqOutput);
+
     } else {
       // build, or load, transducer
-      const bool loadMachine = vm.count("load-machine");
-      Machine machine = loadMachine
+      Require (!(vm.count("load-machine") && vm.count("load-machine-bin")), "--load-machine and --load-machine-bin can't be used together");
+      const bool loadMachine = vm.count("load-machine") || vm.count("load-machine-bin");
+      Machine machine = vm.count("load-machine")
 	? Machine::fromFile(vm.at("load-machine").as<string>().c_str())
-	: builder.makeMachine();
+	: vm.count("load-machine-bin")
+	? FrozenMachine(vm.at("load-machine-bin").as<string>().c_str()).thaw()
+	: (vm.count("cache-dir")
+	   ? builder.makeCachedMachine (vm.at("cache-dir").as<string>(), !vm.count("print-controls"))
+	   : builder.makeMachine());
 
       if (!loadMachine && vm.count("print-controls"))
 	cout << "Control words: " << join(builder.controlWordString) << endl;
+      if (!loadMachine)
+	writeBuildProfile (vm, builder);
 
       // pre-compose transducers
       if (vm.count("compose-machine")) {
 	const vector<string> comps = vm.at("compose-machine").as<vector<string> >();
-	for (auto iter = comps.rbegin(); iter != comps.rend(); ++iter) {
-	  LogThisAt(3,"Pre-composing with " << *iter << endl);
-	  machine = Machine::compose (Machine::fromFile((*iter).c_str()), machine);
+	vguard<Machine> chain;
+	for (const auto& comp: comps) {
+	  LogThisAt(3,"Pre-composing with " << comp << endl);
+	  chain.push_back (Machine::fromFile (comp.c_str()));
 	}
+	chain.push_back (std::move (machine));
+	machine = Machine::compose (chain);
       }
 
+      if (vm.count("minimize"))
+	machine = machine.minimize();
+
       // save transducer
       if (vm.count("save-machine")) {
 	const string savefile = vm.at("save-machine").as<string>();
@@ -174,57 +352,29 @@ int main (int argc, char** argv) {
 	  machine.writeJSON (out);
 	}
       }
+      if (vm.count("save-machine-bin"))
+	FrozenMachine(machine).saveBinary (vm.at("save-machine-bin").as<string>());
 
       // encoding or decoding?
-      if (vm.count("encode-file")) {
-	const string filename = vm.at("encode-file").as<string>();
-	ifstream infile (filename, std::ios::binary);
-	if (!infile)
-	  throw runtime_error ("Binary file not found");
-	FastaWriter writer (cout, rawSeqOutput ? NULL : filename.c_str());
-	Encoder<FastaWriter> encoder (machine, writer);
-	encoder.encodeStream (infile);
-	
-      } else if (vm.count("decode-file")) {
-	const vguard<FastSeq> fastSeqs = readFastSeqs (vm.at("decode-file").as<string>().c_str());
-	BinaryWriter writer (cout);
-	Decoder<BinaryWriter> decoder (machine, writer);
-	for (auto& fs: fastSeqs)
-	  decoder.decodeString (fs.seq);
-
-      } else if (vm.count("encode-string")) {
-	FastaWriter writer (cout, rawSeqOutput ? NULL : "ASCII_string");
-	Encoder<FastaWriter> encoder (machine, writer);
-	encoder.encodeString (vm.at("encode-string").as<string>());
-      
-      } else if (vm.count("decode-string")) {
-	BinaryWriter writer (cout);
-	Decoder<BinaryWriter> decoder (machine, writer);
-	decoder.decodeString (vm.at("decode-string").as<string>());
-
-      } else if (vm.count("encode-bits")) {
-	FastaWriter writer (cout, rawSeqOutput ? NULL : "bit_string");
-	Encoder<FastaWriter> encoder (machine, writer);
-	encoder.encodeSymbolString (vm.at("encode-bits").as<string>());
-      
-      } else if (vm.count("decode-bits")) {
-	Decoder<ostream> decoder (machine, cout);
-	decoder.decodeString (vm.at("decode-bits").as<string>());
-	decoder.close();
-
-	cout << endl;
+      if (encodesOrDecodes (vm)) {
+	const FrozenMachine frozen (machine);
+	machine = Machine();  // only the frozen copy is needed from here on
+	encodeOrDecode (vm, frozen, rawSeqOutput);
 
       } else if (vm.count("decode-viterbi")) {
-	const auto decoded = decodeFastSeqs (vm.at("decode-viterbi").as<string>().c_str(), machine, mut);
-	if (rawSeqOutput)
-	  for (const auto& fs: decoded)
-	    cout << fs.seq << endl;
-	else
-	  writeFastaSeqs (cout, decoded);
+	decodeFastSeqs (vm.at("decode-viterbi").as<string>().c_str(), machine, mut, vm.at("batch-size").as<size_t>(),
+			[&] (const vguard<FastSeq>& decoded) {
+			  if (rawSeqOutput)
+			    for (const auto& fs: decoded)
+			      cout << fs.seq << endl;
+			  else
+			    writeFastaSeqs (cout, decoded);
+			  cout.flush();
+			});
 	
       } else if (vm.count("rate")) {
 	// Output statistics
-	const auto charBases = machine.expectedBasesPerInputSymbol("01$");
+	const auto charBases = machine.expectedBasesPerInputSymbol ("01$", builder.nThreads);
 	vguard<string> cbstr;
 	for (const auto& cb: charBases)
 	  cbstr.push_back (Machine::charToString(cb.first) + ": " + to_string(cb.second));
@@ -236,7 +386,7 @@ int main (int argc, char** argv) {
 	  machine.writeDot (cout);
 	else if (vm.count("token-info"))
 	  cout << machine.inputDescriptionTable();
-	else if (!vm.count("save-machine"))
+	else if (!vm.count("save-machine") && !vm.count("save-machine-bin"))
 	  machine.write (cout);
       }
     }
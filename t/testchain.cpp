@@ -0,0 +1,65 @@
+#include <random>
+#include <sstream>
+#include "../src/encoder.h"
+#include "../src/decoder.h"
+
+/* Checks that single-pass composition of a machine chain encodes and decodes the same as repeated pairwise composition */
+
+#define TestOK(EXPR) do { if (!(EXPR)) { cout << "Failed: "  #EXPR "\n"; ok = false; } } while (false)
+
+struct StringWriter {
+  string out;
+  void write (const char* buf, size_t n) { out.append (buf, n); }
+};
+
+string encode (const Machine& machine, const string& data) {
+  StringWriter dna;
+  {
+    Encoder<StringWriter> encoder (machine, dna);
+    encoder.encodeString (data);
+  }
+  return dna.out;
+}
+
+string decode (const Machine& machine, const string& dna) {
+  ostringstream decoded;
+  {
+    BinaryWriter writer (decoded);
+    Decoder<BinaryWriter> decoder (machine, writer);
+    decoder.decodeString (dna);
+  }
+  return decoded.str();
+}
+
+int main (int argc, char** argv) {
+  if (argc < 4) {
+    cout << "Usage: " << argv[0] << " <machine1.json> <machine2.json> <machine3.json> [...]" << endl;
+    exit (EXIT_FAILURE);
+  }
+  bool ok = true;
+
+  vguard<Machine> chain;
+  for (int n = 1; n < argc; ++n)
+    chain.push_back (Machine::fromFile (argv[n]));
+
+  Machine pairwise = chain.back();
+  for (auto iter = chain.rbegin() + 1; iter != chain.rend(); ++iter)
+    pairwise = Machine::compose (*iter, pairwise);
+  const Machine composite = Machine::compose (chain);
+  TestOK (composite.nStates() <= pairwise.nStates());
+
+  mt19937 rnd (0);
+  for (size_t len: { 1, 2, 5, 64, 1000 }) {
+    string data (len, 0);
+    for (auto& c: data)
+      c = (char) (rnd() & 0xff);
+    const string dna = encode (pairwise, data);
+    TestOK (encode (composite, data) == dna);
+    TestOK (decode (composite, dna) == data);
+    TestOK (decode (pairwise, encode (composite, data)) == data);
+  }
+
+  cout << (ok ? "ok: chain composition matches pairwise composition" : "not ok: chain composition differs from pairwise composition") << endl;
+
+  return EXIT_SUCCESS;
+}
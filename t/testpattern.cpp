@@ -19,6 +19,44 @@ int main (int argc, char** argv) {
   TestOK (!hasExactNonlocalInvertedRepeat (stringToKmer("ACGTCGT"),7,3,2));
   TestOK (hasExactNonlocalInvertedRepeat (stringToKmer("ACGTTCGT"),8,3,2));
 
+  TestOK (kmerBaseRangeMask(0,4) == kmerBaseRangeMask(1,4));
+  TestOK (kmerBaseRangeMask(1,4) == 0x55);
+  TestOK (kmerBaseRangeMask(3,2) == 0);
+  TestOK (kmerBaseRangeMask(1,32) == KmerBaseLowBits);
+  TestOK (kmerBaseRangeMask(2,32) == (KmerBaseLowBits & ~(Kmer) 1));
+  TestOK (kmerBaseRangeMask(32,33) == (((Kmer) 1) << 62));
+
+  TestOK (kmerString (stringToKmer("GATTACAGATTACAGATTACAGATTACACGTA"), 32) == "GATTACAGATTACAGATTACAGATTACACGTA");
+
+  const KmerRepeatFilter longFilter (32, 4, 2, 4, 3, 2);
+  TestOK (longFilter.tandemRange[0] == KmerBaseLowBits);
+  TestOK (longFilter.localInvRepRange[0] == kmerBaseRangeMask(1,32));
+  TestOK (longFilter.hasTandemRepeat (stringToKmer("ACGTACGTACGTACGTACGTACGTACGTACGT")));
+  TestOK (!longFilter.hasLocalInvertedRepeat (stringToKmer("AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA")));
+
+  for (Pos len = 1; len <= 8; ++len)
+    for (Pos invRepLen = 0; invRepLen <= 3; ++invRepLen) {
+      const KmerRepeatFilter filter (len, len/2, 2, len/2, invRepLen, 2);
+      bool same = true;
+      for (Kmer kmer = 0; same && kmer <= kmerMask(len); ++kmer)
+	same = filter.hasTandemRepeat(kmer) == hasExactTandemRepeat(kmer,len,len/2)
+	  && filter.hasLocalInvertedRepeat(kmer) == hasExactLocalInvertedRepeat(kmer,len,2,len/2)
+	  && filter.hasNonlocalInvertedRepeat(kmer) == hasExactNonlocalInvertedRepeat(kmer,len,invRepLen,2);
+      TestOK (same);
+    }
+
+  MotifSet motifs;
+  for (const char* m: { "ACG", "CG", "GATTACAGAT", "TTAGGCATTACA", "ACG" })
+    motifs.insert (KmerLen (stringToKmer(m), strlen(m)));
+  TestOK (motifs.size() == 4);
+  TestOK (endsWithMotif (stringToKmer("TTTTACG"), 7, motifs));
+  TestOK (endsWithMotif (stringToKmer("TTTTTCG"), 7, motifs));
+  TestOK (!endsWithMotif (stringToKmer("TTTTTCC"), 7, motifs));
+  TestOK (endsWithMotif (stringToKmer("CCTTAGGCATTACA"), 14, motifs));
+  TestOK (motifs.erase (KmerLen (stringToKmer("CG"), 2)) == 1);
+  TestOK (!endsWithMotif (stringToKmer("TTTTTCG"), 7, motifs));
+  TestOK (endsWithMotif (stringToKmer("TTTTACG"), 7, motifs));
+
   cout << (ok ? "ok: pattern recognition works" : "not ok: pattern recognition broken. Email Hubertus.Bigend@BlueAnt.com") << endl;
 
   return EXIT_SUCCESS;
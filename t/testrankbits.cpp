@@ -0,0 +1,34 @@
+#include "../src/rankbits.h"
+#include "../src/util.h"
+
+using namespace std;
+
+#define TestOK(EXPR) do { if (!(EXPR)) { cout << "Failed: "  #EXPR "\n"; ok = false; } } while (false)
+
+int main (int argc, char** argv) {
+  bool ok = true;
+
+  RankBitVector rbv (1000);
+  for (size_t i = 3; i < 1000; i += i / 3)
+    rbv.set (i);
+  rbv.buildIndex();
+  TestOK (rbv.count() == rbv.popcount());
+
+  bool selectOK = true;
+  for (size_t j = 0; j < rbv.count(); ++j)
+    selectOK = selectOK && rbv.test (rbv.select (j)) && rbv.rank (rbv.select (j)) == j;
+  TestOK (selectOK);
+
+  bool rankOK = true;
+  size_t nSet = 0;
+  for (size_t i = 0; i < rbv.size(); ++i) {
+    rankOK = rankOK && rbv.rank (i) == nSet;
+    if (rbv.test (i))
+      ++nSet;
+  }
+  TestOK (rankOK);
+
+  cout << (ok ? "ok: rank/select bit vector works" : "not ok: rank/select bit vector broken") << endl;
+
+  return EXIT_SUCCESS;
+}